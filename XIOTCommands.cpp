@@ -0,0 +1,128 @@
+#include "XIOTCommands.h"
+#include "XIOTLog.h"
+
+XIOTCommandTable::~XIOTCommandTable() {
+  delete[] _commands;
+  free(_nodes);
+}
+
+/**
+ * Add a command. prefix needs to be a static string since it's not copied.
+ * adminOnly commands are refused when the message is not from an admin phone number.
+ * Returns false if the table is full.
+ */
+bool XIOTCommandTable::add(const char* prefix, XIOTCommandHandler handler, bool adminOnly) {
+  if(_commandCount >= COMMAND_MAX_COUNT) {
+    XLog(MODULE, XIOT_LOG_WARN, "Too many commands, %s ignored", prefix);
+    return false;
+  }
+  if(_commandCount >= _commandCapacity) {
+    XIOTCommand* commands = new XIOTCommand[_commandCapacity + COMMAND_ALLOC_STEP];
+    for(int i = 0; i < _commandCount; i++) {
+      commands[i] = _commands[i];
+    }
+    delete[] _commands;
+    _commands = commands;
+    _commandCapacity += COMMAND_ALLOC_STEP;
+  }
+  XIOTCommand* command = &_commands[_commandCount++];
+  command->prefix = prefix;
+  command->adminOnly = adminOnly;
+  command->handler = handler;
+  _compiled = false;
+  _compileFailed = false;
+  return true;
+}
+
+int16_t XIOTCommandTable::_findOrAddChild(int16_t parent, char c) {
+  int16_t node = _nodes[parent].child;
+  while(node >= 0) {
+    if(_nodes[node].c == c) return node;
+    node = _nodes[node].sibling;
+  }
+  if(_nodeCount >= _nodeCapacity) return -1;
+  node = _nodeCount++;
+  _nodes[node].c = c;
+  _nodes[node].command = -1;
+  _nodes[node].child = -1;
+  _nodes[node].sibling = _nodes[parent].child;
+  _nodes[parent].child = node;
+  return node;
+}
+
+/**
+ * Build the trie: node 0 is the root, each command prefix is a path from it, lower cased.
+ * It can't have more nodes than the root plus one per prefix character.
+ */
+bool XIOTCommandTable::_compile() {
+  size_t maxNodes = 1;
+  for(int i = 0; i < _commandCount; i++) {
+    maxNodes += strlen(_commands[i].prefix);
+  }
+  if(maxNodes > COMMAND_TRIE_MAX_NODES) {
+    XLog(MODULE, XIOT_LOG_ERROR, "Command prefixes too long");
+    _compileFailed = true;
+    return false;
+  }
+  if((int16_t)maxNodes > _nodeCapacity) {
+    XIOTTrieNode* nodes = (XIOTTrieNode*)realloc(_nodes, maxNodes * sizeof(XIOTTrieNode));
+    if(nodes == NULL) {
+      XLog(MODULE, XIOT_LOG_ERROR, "Not enough memory for command table");
+      _compileFailed = true;
+      return false;
+    }
+    _nodes = nodes;
+    _nodeCapacity = maxNodes;
+  }
+  _nodeCount = 1;
+  _nodes[0].c = 0;
+  _nodes[0].command = -1;
+  _nodes[0].child = -1;
+  _nodes[0].sibling = -1;
+  for(int i = 0; i < _commandCount; i++) {
+    int16_t node = 0;
+    for(const char* c = _commands[i].prefix; *c && node >= 0; c++) {
+      node = _findOrAddChild(node, tolower(*c));
+    }
+    _nodes[node].command = i;
+  }
+  _compiled = true;
+  return true;
+}
+
+/**
+ * Call the handler of the command matching the message.
+ * Returns COMMAND_NOT_FOUND if there is none, COMMAND_REFUSED for an admin command from a
+ * non admin number, or the result of the handler (COMMAND_OK, COMMAND_FAILED)
+ */
+int XIOTCommandTable::dispatch(const char* phoneNumber, bool isAdmin, const char* message) {
+  if(message == NULL || _commandCount == 0) return COMMAND_NOT_FOUND;
+  if(_compileFailed || (!_compiled && !_compile())) return COMMAND_NOT_FOUND;
+  while(*message == ' ') message++;
+  
+  // Walk the trie, remembering the longest prefix ending on a word boundary
+  int8_t matched = -1;
+  const char* args = NULL;
+  int16_t node = 0;
+  const char* c = message;
+  while(*c) {
+    int16_t child = _nodes[node].child;
+    char lower = tolower(*c);
+    while(child >= 0 && _nodes[child].c != lower) {
+      child = _nodes[child].sibling;
+    }
+    if(child < 0) break;
+    node = child;
+    c++;
+    if(_nodes[node].command >= 0 && (*c == 0 || *c == ' ')) {
+      matched = _nodes[node].command;
+      args = c;
+    }
+  }
+  if(matched < 0) return COMMAND_NOT_FOUND;
+  
+  XIOTCommand* command = &_commands[matched];
+  if(command->adminOnly && !isAdmin) return COMMAND_REFUSED;
+  while(*args == ' ') args++;
+  return command->handler(phoneNumber, isAdmin, args) ? COMMAND_OK : COMMAND_FAILED;
+}
@@ -0,0 +1,63 @@
+/**
+ *  SMS command table for iotinator modules
+ *  Xavier Grosjean 2018
+ *  Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International Public License
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+// Storage is allocated on demand: commands by steps of COMMAND_ALLOC_STEP, trie nodes when compiling
+#define COMMAND_ALLOC_STEP 4
+#define COMMAND_MAX_COUNT 127
+#define COMMAND_TRIE_MAX_NODES 2048
+
+// Dispatch results
+#define COMMAND_NOT_FOUND -1
+#define COMMAND_FAILED 0
+#define COMMAND_OK 1
+#define COMMAND_REFUSED 2
+
+// args points to what follows the command prefix in the message, without leading spaces
+typedef std::function<bool(const char* phoneNumber, bool isAdmin, const char* args)> XIOTCommandHandler;
+
+/**
+ * Commands are added with the prefix a message needs to start with (case insensitive, whole words)
+ * and are compiled into a prefix trie on first dispatch: a message is then matched in one pass
+ * over its characters, the longest matching prefix wins.
+ * Modules without commands don't allocate anything.
+ */
+class XIOTCommandTable {
+public:
+  ~XIOTCommandTable();
+  bool add(const char* prefix, XIOTCommandHandler handler, bool adminOnly = false);
+  int dispatch(const char* phoneNumber, bool isAdmin, const char* message);
+  
+protected:
+  typedef struct {
+    const char* prefix;   // Needs to be a static string: it is not copied
+    bool adminOnly;
+    XIOTCommandHandler handler;
+  } XIOTCommand;
+  
+  typedef struct {
+    char c;
+    int8_t command;       // index of the command ending on this node, or -1
+    int16_t child;        // first child node, or -1
+    int16_t sibling;      // next node with same parent, or -1
+  } XIOTTrieNode;
+  
+  bool _compile();
+  int16_t _findOrAddChild(int16_t parent, char c);
+  
+  XIOTCommand* _commands = NULL;
+  uint8_t _commandCount = 0;
+  uint8_t _commandCapacity = 0;
+  XIOTTrieNode* _nodes = NULL;
+  int16_t _nodeCount = 0;
+  int16_t _nodeCapacity = 0;
+  bool _compiled = false;
+  bool _compileFailed = false;    // Not retried until the table changes
+};
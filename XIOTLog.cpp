@@ -0,0 +1,84 @@
+#include "XIOTLog.h"
+
+char XIOTLog::_buffer[XIOT_LOG_BUFFER_SIZE];
+uint32_t XIOTLog::_written = 0;
+uint32_t XIOTLog::_drained = 0;
+uint32_t XIOTLog::_dropped = 0;
+
+static const char logLevelLetters[] = "-EWID";
+
+/**
+ * Format a log line in the ring buffer, with level and time since boot.
+ * Lines don't need to end with \n, it's added if missing.
+ */
+void XIOTLog::log(uint8_t level, const char* format, ...) {
+  char line[XIOT_LOG_LINE_MAX_LENGTH + 1];
+  int length = snprintf(line, XIOT_LOG_LINE_MAX_LENGTH, "%c %lu ",
+                        logLevelLetters[level <= XIOT_LOG_DEBUG ? level : 0], millis());
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line + length, XIOT_LOG_LINE_MAX_LENGTH - length, format, args);
+  va_end(args);
+  length = strlen(line);
+  if(length == 0 || line[length - 1] != '\n') {
+    line[length++] = '\n';
+  }
+  _write(line, length);
+}
+
+void XIOTLog::_write(const char* data, size_t length) {
+  for(size_t i = 0; i < length; i++) {
+    _buffer[(_written + i) % XIOT_LOG_BUFFER_SIZE] = data[i];
+  }
+  _written += length;
+  // Lines not sent to Serial yet have been overwritten
+  if(_written - _drained > XIOT_LOG_BUFFER_SIZE) {
+    _dropped += _written - _drained - XIOT_LOG_BUFFER_SIZE;
+    _drained = _written - XIOT_LOG_BUFFER_SIZE;
+  }
+}
+
+/**
+ * Write pending logs to Serial, only as much as its output buffer can take without blocking.
+ */
+void XIOTLog::drain() {
+  while(_drained != _written) {
+    size_t available = Serial.availableForWrite();
+    if(available == 0) return;
+    size_t position = _drained % XIOT_LOG_BUFFER_SIZE;
+    // Don't go beyond the end of buffer in one write
+    size_t length = _written - _drained;
+    if(length > XIOT_LOG_BUFFER_SIZE - position) length = XIOT_LOG_BUFFER_SIZE - position;
+    if(length > available) length = available;
+    Serial.write((const uint8_t*)_buffer + position, length);
+    _drained += length;
+  }
+}
+
+/**
+ * Copy the most recent complete log lines into buffer, oldest first, null terminated.
+ * Returns the copied length.
+ */
+size_t XIOTLog::copy(char* buffer, size_t maxLen) {
+  if(maxLen == 0) return 0;
+  uint32_t start = (_written > XIOT_LOG_BUFFER_SIZE) ? _written - XIOT_LOG_BUFFER_SIZE : 0;
+  if(_written - start > maxLen - 1) start = _written - (maxLen - 1);
+  // Skip the partially overwritten first line
+  if(start > 0) {
+    while(start < _written && _buffer[start % XIOT_LOG_BUFFER_SIZE] != '\n') start++;
+    if(start < _written) start++;
+  }
+  size_t length = 0;
+  for(uint32_t i = start; i < _written; i++) {
+    buffer[length++] = _buffer[i % XIOT_LOG_BUFFER_SIZE];
+  }
+  buffer[length] = 0;
+  return length;
+}
+
+/**
+ * Returns the number of bytes that were overwritten before they could be sent to Serial
+ */
+uint32_t XIOTLog::getDropped() {
+  return _dropped;
+}
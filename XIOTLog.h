@@ -0,0 +1,64 @@
+/**
+ *  Leveled logging to a ring buffer for iotinator modules
+ *  Xavier Grosjean 2018
+ *  Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International Public License
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+#define XIOT_LOG_NONE 0
+#define XIOT_LOG_ERROR 1
+#define XIOT_LOG_WARN 2
+#define XIOT_LOG_INFO 3
+#define XIOT_LOG_DEBUG 4
+
+// Size of the ring buffer keeping the most recent logs
+#ifndef XIOT_LOG_BUFFER_SIZE
+#define XIOT_LOG_BUFFER_SIZE 2048
+#endif
+// Longer log lines are truncated
+#define XIOT_LOG_LINE_MAX_LENGTH 200
+
+// Each subsystem has its own level, XLog(SUBSYSTEM, level, ...) calls above it are compiled out.
+// Define XIOT_LOG_LEVEL_<SUBSYSTEM> before including this file to override them.
+#ifndef XIOT_LOG_LEVEL_MODULE
+#define XIOT_LOG_LEVEL_MODULE XIOT_LOG_INFO
+#endif
+#ifndef XIOT_LOG_LEVEL_WIFI
+#define XIOT_LOG_LEVEL_WIFI XIOT_LOG_INFO
+#endif
+#ifndef XIOT_LOG_LEVEL_HTTP
+#define XIOT_LOG_LEVEL_HTTP XIOT_LOG_INFO
+#endif
+#ifndef XIOT_LOG_LEVEL_PAYLOAD
+#define XIOT_LOG_LEVEL_PAYLOAD XIOT_LOG_INFO
+#endif
+
+#define XLog(subsystem, level, ...) do { \
+  if((level) <= XIOT_LOG_LEVEL_##subsystem) XIOTLog::log((level), __VA_ARGS__); \
+} while(0)
+
+/**
+ * Log lines are formatted into a ring buffer instead of being written to Serial right away,
+ * which blocks the loop for milliseconds with long lines.
+ * drain() writes to Serial only what it can without blocking, it's called at the end of
+ * XIOTModule::loop(). The buffer content also remains available for GET /api/logs
+ */
+class XIOTLog {
+public:
+  static void log(uint8_t level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+  static void drain();
+  static size_t copy(char* buffer, size_t maxLen);
+  static uint32_t getDropped();
+
+protected:
+  static void _write(const char* data, size_t length);
+  
+  static char _buffer[XIOT_LOG_BUFFER_SIZE];
+  // Absolute counts of bytes, positions in buffer are these modulo the buffer size
+  static uint32_t _written;
+  static uint32_t _drained;
+  static uint32_t _dropped;
+};
@@ -23,6 +23,21 @@ const char* XIOTModuleJsonTag::connected = "connected";
 const char* XIOTModuleJsonTag::heap = "heap";
 const char* XIOTModuleJsonTag::pingPeriod = "pingPeriod";
 const char* XIOTModuleJsonTag::registeringTime = "regTime";
+const char* XIOTModuleJsonTag::retryAfter = "retryAfter";
+const char* XIOTModuleJsonTag::regSlot = "regSlot";
+const char* XIOTModuleJsonTag::configVersion = "configVersion";
+const char* XIOTModuleJsonTag::registerRequest = "register";
+const char* XIOTModuleJsonTag::registered = "registered";
+const char* XIOTModuleJsonTag::relay = "relay";
+const char* XIOTModuleJsonTag::agents = "agents";
+const char* XIOTModuleJsonTag::payload = "payload";
+const char* XIOTModuleJsonTag::results = "results";
+
+// Names of the watched hooks, in XIOTHook order
+static const char* hookNames[HOOK_COUNT] = {
+  "customLoop", "useData", "processSMS", "customData", "globalStatus", "customSample",
+  "customOnStaGotIpHandler", "customGotConfig", "customRegistered", "customBeforeOTA"
+};
 
 /**
  * This constructor is used by master iotinator, just to take advantage of
@@ -33,6 +48,7 @@ XIOTModule::XIOTModule(DisplayClass *display, bool flipScreen, uint8_t brightnes
 //  _setupOTA();
   _oledDisplay = display;
   _server = new ESP8266WebServer(80);
+  _initHookBudgets();
 }
 
 /**
@@ -41,14 +57,26 @@ XIOTModule::XIOTModule(DisplayClass *display, bool flipScreen, uint8_t brightnes
 XIOTModule::XIOTModule(ModuleConfigClass* config, int displayAddr, int displaySda, int displayScl, bool flipScreen, uint8_t brightness) {
   WiFi.mode(WIFI_OFF);  // Make sure reconnection will be handled properly after reset
 //  _setupOTA();
+  WiFi.persistent(false);  // Connection settings are handled by the module, don't write them to flash on each connection
   _config = config;
-  Serial.print("Initializing module ");
-  Serial.println(config->getName());
+  _initHookBudgets();
+  XLog(MODULE, XIOT_LOG_INFO, "Initializing module %s", config->getName());
+
+  // Waking up from a duty cycle deep sleep: restore what's needed to skip config and registration
+  if(_readSleepState()) {
+    _registered = _sleepState.registered;
+    if(_sleepState.time.epoch != 0) {
+      _timeSync.resume(&_sleepState.time, _sleepState.sleepPeriod * 1000);
+      _timeInitialized = true;
+    }
+    // Module went to sleep with radio disabled for this wake
+    _radioOff = (_sleepState.wakesPerPost > 1) && (_sleepState.wakeCount % _sleepState.wakesPerPost != 0);
+  }
 
   // Initialise the OLED display
   _initDisplay(displayAddr, displaySda, displayScl, flipScreen, brightness);
   if(config->getUiClassName()[0] == 0) {
-    Serial.println("No uiClassName !!");
+    XLog(MODULE, XIOT_LOG_ERROR, "No uiClassName !!");
     _oledDisplay->setLine(2, "No uiClassName !", NOT_TRANSIENT, NOT_BLINKING);
     _oledDisplay->alertIconOn(true);
   }  
@@ -68,31 +96,69 @@ XIOTModule::XIOTModule(ModuleConfigClass* config, int displayAddr, int displaySd
       _oledDisplay->setLine(0, message, NOT_TRANSIENT, NOT_BLINKING);
       ArduinoOTA.begin();    
     } else {
-      Serial.printf("Got IP on %s: %s\n", _config->getSsid(), _localIP);
+      XLog(WIFI, XIOT_LOG_INFO, "Got IP on %s: %s", _config->getSsid(), _localIP);
+      bool throughRelay = (ipInfo.gw[2] != MASTER_SUBNET);
+      // A relay must be connected to master itself, not to another relay
+      if(_relay && throughRelay) {
+        _relayRefuseAP();
+        return;
+      }
       _wifiConnected = true;
+      _fastConnecting = false;
+      // Don't stick to a relay: next connection will look for the best access point again
+      if(throughRelay) {
+        _clearWifiCache();
+      } else {
+        _saveWifiCache();
+      }
       _canQueryMasterConfig = true;
+      // Don't query master right away: wait for this module's slot, unless it was already
+      // waited for before reconnecting
+      unsigned int slot = _slotWaited ? 0 : _registrationSlot();
+      _slotWaited = false;
+      _timeLastGetConfig = millis();
+      _timeLastRegister = _timeLastGetConfig;
+      _getConfigDelay = slot;
+      _registerDelay = slot;
       _wifiDisplay();
       
       // If connected to the customized SSID, module can register itself to master
       if(strcmp(DEFAULT_APPWD, _config->getPwd()) != 0) {
         _canRegister = true;
       }
+      // Already registered before sleeping: no need to do it again
+      if(_dutyCycle && _registered) {
+        _canQueryMasterConfig = false;
+        _canRegister = false;
+      }
+      unsigned long hookStart = micros();
       customOnStaGotIpHandler(ipInfo);
+      _hookEnd(HOOK_STA_GOT_IP, hookStart);
     }
   }); 
   
   _wifiSTADisconnectedHandler = WiFi.onStationModeDisconnected([&](WiFiEventStationModeDisconnected event) {
     // Continuously get messages, so just output once.
     if(_wifiConnected && !isWaitingOTA() ) {
-      Serial.printf("Lost connection to %s, error: %d\n", event.ssid.c_str(), event.reason);
+      XLog(WIFI, XIOT_LOG_WARN, "Lost connection to %s, error: %d", event.ssid.c_str(), event.reason);
       _oledDisplay->setLine(1, "Disconnected", TRANSIENT, NOT_BLINKING);
-      _connectSTA();
+      // When master restarts, all agents lose their connection at the same time: reconnect in
+      // this module's slot to spread associations and DHCP requests too. Done by loop().
+      WiFi.disconnect();  // Otherwise the SDK reconnects right away
+      _wifiConnected = false;
+      _canQueryMasterConfig = false;
+      _canRegister = false;
+      _reconnectPending = true;
+      _timeDisconnected = millis();
     }
   });
 
   // Module is Wifi Station only
-  WiFi.mode(WIFI_STA);  
-  _connectSTA();
+  if(!_radioOff) {
+    WiFi.mode(WIFI_STA);  
+    _connectSTA();
+    _timeSync.begin(false);
+  }
 }
 
 ESP8266WebServer* XIOTModule::getServer() {
@@ -106,24 +172,23 @@ void XIOTModule::addModuleEndpoints() {
   //ask server to track these headers
   _server->collectHeaders(headerkeys, headerkeyssize );
     
-  _server->on("/api/ping", HTTP_GET, [&]() {
+  addRoute("/api/ping", ROUTE_GET, [&]() {
     sendData(true);    
   });
 
-  _server->on("/api/moduleReset", HTTP_GET, [&](){
-    Serial.println("Rq on /api/moduleReset");
+  addRoute("/api/moduleReset", ROUTE_GET, [&](){
+    XLog(HTTP, XIOT_LOG_INFO, "Rq on /api/moduleReset");
     _config->initFromDefault();
     _config->saveToEeprom();
     sendJson("{}", 200);   // HTTP code 200 is enough 
   });
 
-  _server->on("/api/rename", HTTP_POST, [&]() {
+  addRoute("/api/rename", ROUTE_POST, [&]() {
     String forwardTo = _server->header("Xiot-forward-to");   // when an agent can be a proxy to other agents
     String jsonBody = _server->arg("plain");
     if(forwardTo.length() != 0) { 
       int httpCode;   
-      Serial.print("Forwarding rename to ");
-      Serial.println(forwardTo);
+      XLog(HTTP, XIOT_LOG_INFO, "Forwarding rename to %s", forwardTo.c_str());
       // TODO process error
       APIPost(forwardTo, "/api/rename", jsonBody, &httpCode, NULL, 0);
     } else {
@@ -152,12 +217,11 @@ void XIOTModule::addModuleEndpoints() {
 
   // Return this module's custom data if any
   // Almost like ping request except for heap size. Is it worth it ? Could be exact same... 
-  _server->on("/api/data", HTTP_GET, [&]() {
+  addRoute("/api/data", ROUTE_GET, [&]() {
     String forwardTo = _server->header("Xiot-forward-to");
     int httpCode;
     if(forwardTo.length() != 0) {    
-      Serial.print("Forwarding GET /api/data to ");
-      Serial.println(forwardTo);
+      XLog(HTTP, XIOT_LOG_INFO, "Forwarding GET /api/data to %s", forwardTo.c_str());
       char message[1000];
       APIGet(forwardTo, "/api/data", &httpCode, message, 1000);
       if(httpCode == 200) {
@@ -169,25 +233,42 @@ void XIOTModule::addModuleEndpoints() {
   });
   
   // The BackBone framework uses PUT to save data from UI to modules  
-  _server->on("/api/data", HTTP_PUT, [&]() {
-    _processPostPut();
-  });
-  
   // But the modules can't PUT, they POST: handle both
-  _server->on("/api/data", HTTP_POST, [&]() {
+  addRoute("/api/data", ROUTE_PUT | ROUTE_POST, [&]() {
     _processPostPut();
   });
       
-  _server->on("/api/sms", HTTP_POST, [&]() {
+  addRoute("/api/sms", ROUTE_POST, [&]() {
     _processSMS();
   });
       
-  _server->on("/api/restart", HTTP_GET, [&](){
+  // Several SMS at once, when master drains its backlog: one payload in response
+  addRoute("/api/smsBatch", ROUTE_POST, [&]() {
+    _processSMSBatch();
+  });
+      
+  // Most recent logs, even those not sent to serial port yet
+  addRoute("/api/logs", ROUTE_GET, [&]() {
+    char* logs = (char*)malloc(LOGS_RESPONSE_MAX_SIZE + 1);
+    if(logs == NULL) {
+      sendText("", 500);
+      return;
+    }
+    XIOTLog::copy(logs, LOGS_RESPONSE_MAX_SIZE + 1);
+    sendText(logs, 200);
+    free(logs);
+  });
+      
+  // Hooks execution times and budget violations
+  addRoute("/api/watchdog", ROUTE_GET, [&]() {
+    _sendWatchdog();
+  });
+      
+  addRoute("/api/restart", ROUTE_GET, [&](){
     String forwardTo = _server->header("Xiot-forward-to");
     int httpCode;
     if(forwardTo.length() != 0) {    
-      Serial.print("Forwarding restart to ");
-      Serial.println(forwardTo);
+      XLog(HTTP, XIOT_LOG_INFO, "Forwarding restart to %s", forwardTo.c_str());
       APIGet(forwardTo, "/api/restart", &httpCode, NULL, 0);
     } else {
       sendHtml("restarting", 200);
@@ -197,7 +278,7 @@ void XIOTModule::addModuleEndpoints() {
   });
   
   // OTA: update. NB: for now, master has its own api endpoint 
-  _server->on("/api/ota", HTTP_POST, [&]() {
+  addRoute("/api/ota", ROUTE_POST, [&]() {
     String jsonBody = _server->arg("plain");
     int httpCode = 200;
     char ssid[SSID_MAX_LENGTH];
@@ -222,17 +303,61 @@ void XIOTModule::addModuleEndpoints() {
   _server->begin();
 }    
 
+/**
+ * Add an API endpoint to this module.
+ * Prefer this to _server->on(): routes are looked up in a hash table instead of being
+ * compared one by one to the uri of each request.
+ * path needs to be a static string, segments starting with ':' are parameters whose values
+ * can be read with routeParam(), like /api/channel/:id
+ * methods is a bitmask like ROUTE_GET | ROUTE_POST
+ * NB: routes are dispatched from the server's "not found" handler: use onNotFound() rather
+ * than overriding it.
+ */
+bool XIOTModule::addRoute(const char* path, uint8_t methods, XIOTRouteHandler handler) {
+  _installRouter();
+  return _router.on(path, methods, handler);
+}
+
+/**
+ * Handler called for requests matching no route. Without one, a 404 JSON error is sent.
+ */
+void XIOTModule::onNotFound(XIOTRouteHandler handler) {
+  _installRouter();
+  _notFoundHandler = handler;
+}
+
+void XIOTModule::_installRouter() {
+  if(_routerInstalled) return;
+  _routerInstalled = true;
+  _server->onNotFound([&]() {
+    if(_router.dispatch(_server->uri().c_str(), _server->method())) return;
+    if(_notFoundHandler) {
+      _notFoundHandler();
+    } else {
+      sendJson("{\"error\": \"Not found\"}", 404);
+    }
+  });
+}
+
+/**
+ * Returns the value of the index-th parameter in the path of the route being handled.
+ * Valid while the route handler runs.
+ */
+const char* XIOTModule::routeParam(uint8_t index) {
+  return _router.param(index);
+}
+
 // This is responding to api/ping and api/data (for GET symmetry with put/post on api/data)
 // This is also when refreshing data: not responding to a request but posting to master.
 int XIOTModule::sendData(bool isResponse) {
   int httpCode = 200;
   char *payloadStr = _buildFullPayload();
   if(isResponse) {
-    Serial.printf("Response: %s\n", payloadStr);
+    XLog(PAYLOAD, XIOT_LOG_DEBUG, "Response: %s", payloadStr);
     sendJson(payloadStr, httpCode);
   } else {
-    Serial.printf("Payload: %s\n", payloadStr);
-    masterAPIPost("/api/refresh", String(payloadStr), &httpCode, NULL, 0);
+    XLog(PAYLOAD, XIOT_LOG_DEBUG, "Payload: %s", payloadStr);
+    masterAPIPost("/api/refresh", payloadStr, &httpCode, NULL, 0);
   }  
   free(payloadStr);
   return httpCode;
@@ -245,13 +370,14 @@ void XIOTModule::_processPostPut() {
   char *response = NULL;
   
   if(forwardTo.length() != 0) {    
-    Serial.print("Forwarding data to ");
-    Serial.println(forwardTo);
+    XLog(HTTP, XIOT_LOG_INFO, "Forwarding data to %s", forwardTo.c_str());
     response = (char *)malloc(1000);
     *response = 0;
     APIPost(forwardTo, "/api/data", body, &httpCode, response, 1000);
   } else {
+    unsigned long hookStart = micros();
     response = useData(body.c_str(), &httpCode);  // Each module subclass should override this if it expects any data from the UI.
+    _hookEnd(HOOK_USE_DATA, hookStart);
     // For now the response can't be used by master to update its agent collection
     // This will be done when master subclasses XIOTModule... 
     // So for now we'll refresh the data on master after this request callback is done
@@ -267,7 +393,7 @@ void XIOTModule::_processPostPut() {
 
 void XIOTModule::_processSMS() {
   String jsonBody = _server->arg("plain");
-  Serial.println(jsonBody); 
+  XLog(PAYLOAD, XIOT_LOG_DEBUG, "SMS: %s", jsonBody.c_str()); 
   const int bufferSize = JSON_OBJECT_SIZE(3) ; 
   StaticJsonBuffer<bufferSize> jsonBuffer;
   JsonObject& root = jsonBuffer.parseObject(const_cast<char*>(jsonBody.c_str())); 
@@ -280,7 +406,7 @@ void XIOTModule::_processSMS() {
   const char *phoneNumber = (const char*)root["phoneNumber"];       
   const bool isAdmin = (const bool)root["isAdmin"];
          
-  bool success = customProcessSMS(phoneNumber, isAdmin, message);
+  bool success = _processSMSMessage(phoneNumber, isAdmin, message);
   if(success) {
     char *payload = _buildFullPayload();
     sendJson(payload, 200);
@@ -292,18 +418,149 @@ void XIOTModule::_processSMS() {
 }    
 
 
+/**
+ * Process an array of SMS like [{"phoneNumber": "...", "isAdmin": false, "message": "..."}, ...]
+ * Once all of them are processed, responds with 200 and the result of each one, in the same order,
+ * with the payload: {"results": [true, false, ...], "payload": {...}}
+ * The number of failed ones is also in the Xiot-sms-failed header.
+ * Commands are not idempotent: a failed message must not make the whole batch be sent again.
+ */
+void XIOTModule::_processSMSBatch() {
+  String jsonBody = _server->arg("plain");
+  XLog(PAYLOAD, XIOT_LOG_DEBUG, "SMS batch: %s", jsonBody.c_str()); 
+  // Larger batches don't fit, parsing fails
+  StaticJsonBuffer<JSON_ARRAY_SIZE(SMS_BATCH_MAX_SIZE) + SMS_BATCH_MAX_SIZE * JSON_OBJECT_SIZE(3)> jsonBuffer;
+  JsonArray& messages = jsonBuffer.parseArray(const_cast<char*>(jsonBody.c_str())); 
+  if (!messages.success() || messages.size() > SMS_BATCH_MAX_SIZE) {
+    sendJson("{}", 500);
+    _oledDisplay->setLine(1, "SMS bad payload", TRANSIENT, NOT_BLINKING);
+    return;
+  }
+  int failed = 0;
+  char results[SMS_BATCH_MAX_SIZE * 6 + 3];
+  char* result = results;
+  *result++ = '[';
+  for(JsonVariant item : messages) {
+    JsonObject& sms = item.as<JsonObject>();
+    bool success = _processSMSMessage((const char*)sms["phoneNumber"], (bool)sms["isAdmin"], (const char*)sms["message"]);
+    if(!success) {
+      failed ++;
+    }
+    result += sprintf(result, "%s%s", (result - results > 1) ? "," : "", success ? "true" : "false");
+  }
+  strcpy(result, "]");
+  char failedStr[10];
+  sprintf(failedStr, "%d", failed);
+  _server->sendHeader("Xiot-sms-failed", failedStr);
+  char *payload = _buildFullPayload();
+  size_t length = strlen(results) + (payload ? strlen(payload) : 2) + 40;
+  char* response = (char*)malloc(length);
+  if(response == NULL) {
+    sendJson("{}", 500);
+  } else {
+    snprintf(response, length, "{\"%s\": %s, \"%s\": %s}", XIOTModuleJsonTag::results, results,
+             XIOTModuleJsonTag::payload, payload ? payload : "{}");
+    sendJson(response, 200);
+    free(response);
+  }
+  free(payload);
+}
+
+/**
+ * Dispatch a message to the command registered with addSMSCommand matching it,
+ * or to customProcessSMS if there is none.
+ */
+bool XIOTModule::_processSMSMessage(const char* phoneNumber, const bool isAdmin, const char* message) {
+  unsigned long hookStart = micros();
+  int result = _smsCommands.dispatch(phoneNumber, isAdmin, message);
+  if(result == COMMAND_NOT_FOUND) {
+    bool success = customProcessSMS(phoneNumber, isAdmin, message);
+    _hookEnd(HOOK_PROCESS_SMS, hookStart);
+    return success;
+  }
+  _hookEnd(HOOK_PROCESS_SMS, hookStart);
+  if(result == COMMAND_REFUSED) {
+    XLog(MODULE, XIOT_LOG_WARN, "SMS command refused for %s", phoneNumber);
+  }
+  return (result == COMMAND_OK);
+}
+
+/**
+ * Register a handler for SMS messages starting with prefix (case insensitive, whole words),
+ * it gets what follows the prefix as args. prefix needs to be a static string.
+ * Messages matching no command still go to customProcessSMS.
+ */
+bool XIOTModule::addSMSCommand(const char* prefix, XIOTCommandHandler handler, bool adminOnly) {
+  return _smsCommands.add(prefix, handler, adminOnly);
+}
+
 /**
  * Connects to the SSID read in config
+ * If the previous connection to it is in the RTC memory cache, try to connect directly
+ * to the same BSSID on the same channel: no scan. The address is still obtained with DHCP.
+ * loop() falls back to a regular connection if it does not succeed quickly.
  */
 void XIOTModule::_connectSTA() {
   _canQueryMasterConfig = false;
   _canRegister = false;
   _wifiConnected = false;
   Debug("XIOTModule::_connectSTA %s\n", _config->getSsid());
-  WiFi.begin(_config->getSsid(), _config->getPwd());
+  XIOTWifiCache cache;
+  if(_readWifiCache(&cache)) {
+    XLog(WIFI, XIOT_LOG_INFO, "Fast connect to %s on channel %d", _config->getSsid(), cache.channel);
+    WiFi.config(0U, 0U, 0U);  // Back to DHCP
+    WiFi.begin(_config->getSsid(), _config->getPwd(), cache.channel, cache.bssid);
+    _fastConnecting = true;
+  } else if(_relay && _refusedBssidCount > 0) {
+    // Called from WiFi event handlers, where scanning can't be done: it's started by loop()
+    WiFi.config(0U, 0U, 0U);  // Back to DHCP
+    _relayScanNeeded = true;
+    _timeLastRelayScan = millis() - RELAY_SCAN_RETRY_PERIOD;   // Scan right away
+    _fastConnecting = false;
+  } else {
+    WiFi.config(0U, 0U, 0U);  // Back to DHCP
+    WiFi.begin(_config->getSsid(), _config->getPwd());
+    _fastConnecting = false;
+  }
+  _timeConnectStart = millis();
   _wifiDisplay();
 }
 
+uint32_t XIOTModule::_wifiCredentialsHash() {
+  const char* ssid = _config->getSsid();
+  const char* pwd = _config->getPwd();
+  uint32_t hash = XIOTRouter::hash((const uint8_t*)ssid, strlen(ssid) + 1);
+  return XIOTRouter::hash((const uint8_t*)pwd, strlen(pwd), hash);
+}
+
+/**
+ * Read the last connection from RTC memory.
+ * Returns false if there is none, or if it was not made to the SSID currently in config.
+ */
+bool XIOTModule::_readWifiCache(XIOTWifiCache* cache) {
+  if(!ESP.rtcUserMemoryRead(RTC_WIFI_CACHE_OFFSET, (uint32_t*)cache, sizeof(XIOTWifiCache))) {
+    return false;
+  }
+  uint32_t hash = XIOTRouter::hash((const uint8_t*)cache + sizeof(cache->hash), sizeof(XIOTWifiCache) - sizeof(cache->hash));
+  return (hash == cache->hash && cache->ssidHash == _wifiCredentialsHash() && cache->channel != 0);
+}
+
+void XIOTModule::_saveWifiCache() {
+  XIOTWifiCache cache;
+  cache.ssidHash = _wifiCredentialsHash();
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.unused = 0;
+  cache.hash = XIOTRouter::hash((const uint8_t*)&cache + sizeof(cache.hash), sizeof(XIOTWifiCache) - sizeof(cache.hash));
+  ESP.rtcUserMemoryWrite(RTC_WIFI_CACHE_OFFSET, (uint32_t*)&cache, sizeof(XIOTWifiCache));
+}
+
+void XIOTModule::_clearWifiCache() {
+  XIOTWifiCache cache;
+  memset(&cache, 0, sizeof(XIOTWifiCache));
+  ESP.rtcUserMemoryWrite(RTC_WIFI_CACHE_OFFSET, (uint32_t*)&cache, sizeof(XIOTWifiCache));
+}
+
 
 DisplayClass* XIOTModule::getDisplay() {
   return _oledDisplay;
@@ -313,6 +570,7 @@ void XIOTModule::_getConfigFromMaster() {
   Debug("XIOTModule::_getConfigFromMaster\n");
   int httpCode = 0;
   char jsonString[JSON_STRING_CONFIG_SIZE + 1]; 
+  *jsonString = 0;
   _oledDisplay->setLine(1, "Getting config...", TRANSIENT, NOT_BLINKING);
   masterAPIGet("/api/config", &httpCode, jsonString, JSON_STRING_CONFIG_SIZE);
   StaticJsonBuffer<JSON_BUFFER_CONFIG_SIZE>  jsonBuffer;
@@ -320,19 +578,40 @@ void XIOTModule::_getConfigFromMaster() {
   if(httpCode == 200) {
     _canQueryMasterConfig = false;
     _oledDisplay->setLine(1, "Got config", TRANSIENT, NOT_BLINKING);
-    customGotConfig(true);
+    // Master can assign a registration slot to spread registrations of all agents
+    if(root.containsKey(XIOTModuleJsonTag::regSlot)) {
+      _timeLastRegister = millis();
+      _registerDelay = _masterDelay(root, XIOTModuleJsonTag::regSlot, 0);
+    }
+    _customGotConfig(true);
   } else {
+    // Master can ask to retry later when it's too busy
+    _getConfigDelay = _masterDelay(root, XIOTModuleJsonTag::retryAfter, REGISTRATION_RETRY_PERIOD);
     _oledDisplay->setLine(1, "Getting config failed", TRANSIENT, NOT_BLINKING);
-    customGotConfig(false);
+    _customGotConfig(false);
     return;
   }
+  _applyMasterConfig(root);
+}
 
+/**
+ * Set time, and access point credentials if they changed, from master config
+ */
+void XIOTModule::_applyMasterConfig(JsonObject& root) {
+  if(root.containsKey(XIOTModuleJsonTag::configVersion)) {
+    _configVersion = root[XIOTModuleJsonTag::configVersion];
+  }
   bool masterTimeInitialized = root[XIOTModuleJsonTag::timeInitialized];
 
   if(masterTimeInitialized) {
-    long timestamp = root[XIOTModuleJsonTag::timestamp];
-    setTime(timestamp);
-    _timeInitialized = true;
+    // The timestamp is only accurate to the second and doesn't account for latency:
+    // use it until time is synchronized with master
+    if(!_timeSync.isSynchronized()) {
+      long timestamp = root[XIOTModuleJsonTag::timestamp];
+      setTime(timestamp);
+      _timeInitialized = true;
+    }
+    _timeSync.requestSync();
   }
   bool APInitialized = root[XIOTModuleJsonTag::APInitialized];
   // If access point on Master was customized, get its ssid and password,
@@ -346,8 +625,71 @@ void XIOTModule::_getConfigFromMaster() {
       _config->setPwd(pwd);
       _config->saveToEeprom();     // TODO: partial save only !!!
       _connectSTA();
+      if(_relay) {
+        _startRelayAP();
+      }
+    }
+  }
+}
+
+/**
+ * Get config from master and register in one request: the full payload is sent with the
+ * last known config version, master responds with its config and registration result.
+ * Returns false if master does not support it: config and registration need to be done
+ * with separate requests.
+ */
+bool XIOTModule::_handshake() {
+  Debug("XIOTModule::_handshake\n");
+  int httpCode = 0;
+  char jsonString[JSON_STRING_CONFIG_SIZE + 1]; 
+  *jsonString = 0;
+  bool registering = _canRegister;
+  _oledDisplay->setLine(1, registering ? "Registering" : "Getting config...", TRANSIENT, NOT_BLINKING);
+  char* payload = _buildPayload(true);
+  masterAPIPost("/api/handshake", payload, &httpCode, jsonString, JSON_STRING_CONFIG_SIZE);
+  free(payload);
+  if(httpCode == 404) {
+    XLog(MODULE, XIOT_LOG_INFO, "No handshake on master, falling back to config + register");
+    _handshakeSupported = false;
+    return false;
+  }
+  StaticJsonBuffer<JSON_BUFFER_CONFIG_SIZE>  jsonBuffer;
+  JsonObject& root = jsonBuffer.parseObject(jsonString);
+  if(httpCode != 200) {
+    // Master can ask to retry later when it's too busy
+    _getConfigDelay = _masterDelay(root, XIOTModuleJsonTag::retryAfter, REGISTRATION_RETRY_PERIOD);
+    _oledDisplay->setLine(1, "Handshake failed", TRANSIENT, NOT_BLINKING);
+    _customGotConfig(false);
+    if(registering) {
+      _customRegistered(false);
     }
+    return true;
+  }
+  
+  _canQueryMasterConfig = false;
+  // Payload was sent, master is up to date
+  _refreshNeeded = false;
+  bool registered = registering && root[XIOTModuleJsonTag::registered];
+  if(registered) {
+    _canRegister = false;
+    _registered = true;
+    // Full payload was sent: no need to refresh it before sleeping
+    _sleepState.payloadHash = _builtPayloadHash;
+    _payloadSent = true;
+  } else if(registering) {
+    // Master refused the registration: retry in the slot it assigned, or when it asked to
+    const char* delayTag = root.containsKey(XIOTModuleJsonTag::regSlot) ? XIOTModuleJsonTag::regSlot : XIOTModuleJsonTag::retryAfter;
+    _timeLastRegister = millis();
+    _registerDelay = _masterDelay(root, delayTag, REGISTRATION_RETRY_PERIOD);
   }
+  _oledDisplay->setLine(1, registered ? "Registered" : "Got config", TRANSIENT, NOT_BLINKING);
+  _customGotConfig(true);
+  if(registering) {
+    _customRegistered(registered);
+  }
+  // Done last since it reconnects if the access point changed
+  _applyMasterConfig(root);
+  return true;
 }
 
 /**
@@ -356,28 +698,74 @@ void XIOTModule::_getConfigFromMaster() {
  */
 void XIOTModule::_register() {
   int httpCode;
+  char response[JSON_STRING_REGISTER_RESPONSE_SIZE + 1];
+  *response = 0;
   _oledDisplay->setLine(1, "Registering", TRANSIENT, NOT_BLINKING);
   _wifiDisplay();
   char* payload = _buildFullPayload();
     
   //Serial.println(message);
-  masterAPIPost("/api/register", payload, &httpCode);
+  masterAPIPost("/api/register", payload, &httpCode, response, JSON_STRING_REGISTER_RESPONSE_SIZE);
   if(httpCode == 200) {
     _canRegister = false;
+    _registered = true;
+    // Full payload was sent: no need to refresh it before sleeping
+    _sleepState.payloadHash = _builtPayloadHash;
+    _payloadSent = true;
     _oledDisplay->setLine(1, "Registered", TRANSIENT, NOT_BLINKING);
-    customRegistered(true);
+    _customRegistered(true);
   } else {
+    // Master can ask to retry later when it's too busy
+    StaticJsonBuffer<JSON_OBJECT_SIZE(2)> jsonBuffer;
+    JsonObject& root = jsonBuffer.parseObject(response);
+    _registerDelay = _masterDelay(root, XIOTModuleJsonTag::retryAfter, REGISTRATION_RETRY_PERIOD);
     _oledDisplay->setLine(1, "Registration failed", TRANSIENT, NOT_BLINKING);
-    customRegistered(false);
+    _customRegistered(false);
   }
   free(payload);
 }
 
+/**
+ * Returns the delay (ms) this module waits before reconnecting after losing its connection,
+ * or after getting its IP before querying master.
+ * It's derived from the MAC address so that it is stable across reboots and
+ * different between agents: after a master restart, requests from all agents are spread
+ * over REGISTRATION_SLOT_WINDOW instead of all hitting master at the same time.
+ */
+unsigned int XIOTModule::_registrationSlot() {
+  uint8_t macAddr[6];
+  WiFi.macAddress(macAddr);
+  return XIOTRouter::hash(macAddr, sizeof(macAddr)) % REGISTRATION_SLOT_WINDOW;
+}
+
+/**
+ * Returns the delay (ms) requested by master in the given tag of its response,
+ * or defaultDelay if there is none.
+ */
+unsigned int XIOTModule::_masterDelay(JsonObject& root, const char* tag, unsigned int defaultDelay) {
+  if(!root.success() || !root.containsKey(tag)) {
+    return defaultDelay;
+  }
+  unsigned long requested = root[tag];
+  if(requested > REGISTRATION_MAX_DELAY) {
+    requested = REGISTRATION_MAX_DELAY;
+  }
+  Debug("XIOTModule::_masterDelay %s: %lu\n", tag, requested);
+  return requested;
+}
+
 /**
  * Returns a malloced string with config
  * Caller needs to free it
  */
 char* XIOTModule::_buildFullPayload() {
+  return _buildPayload(false);
+}
+
+/**
+ * Full payload, with what the handshake request needs on top of it if forHandshake is true
+ */
+char* XIOTModule::_buildPayload(bool forHandshake) {
   char macAddrStr[20];
   uint8_t macAddr[6];
   WiFi.macAddress(macAddr);
@@ -388,18 +776,24 @@ char* XIOTModule::_buildFullPayload() {
   root[XIOTModuleJsonTag::ip] = _localIP;
   root[XIOTModuleJsonTag::MAC] = macAddrStr;
   root[XIOTModuleJsonTag::uiClassName] = _config->getUiClassName();
+  unsigned long hookStart = micros();
   char *globalStatus = _globalStatus();
+  _hookEnd(HOOK_GLOBAL_STATUS, hookStart);
   if(globalStatus) {  
     root[XIOTModuleJsonTag::globalStatus] = globalStatus;
   }
   uint32_t freeMem = system_get_free_heap_size();
-  Serial.printf("Free heap mem: %d\n", freeMem);
+  XLog(MODULE, XIOT_LOG_DEBUG, "Free heap mem: %d", freeMem);
   root[XIOTModuleJsonTag::heap] = freeMem;
 
-  // When implemented: return true if module uses sleep feature (battery)
+  // True if module uses sleep feature (battery)
   // So that master won't ping
-  // TODO: handle this in config like getUiClassName
-  root[XIOTModuleJsonTag::canSleep] = false;
+  root[XIOTModuleJsonTag::canSleep] = _dutyCycle;
+
+  if(forHandshake) {
+    root[XIOTModuleJsonTag::configVersion] = _configVersion;
+    root[XIOTModuleJsonTag::registerRequest] = _canRegister;
+  }
 
   // The customPayload is the module's data that will be available to the webApp
   // It's sent to the master when registering, as a JSON string contained in the
@@ -407,7 +801,9 @@ char* XIOTModule::_buildFullPayload() {
   // Sending it as a string means the master won't have trouble computing the Jsonbuffer size
   // since it's just one element instead of an object containing many elements.
   // The customdata will also be sent in response to the ping request from master
+  hookStart = micros();
   char *customPayload = _customData();
+  _hookEnd(HOOK_CUSTOM_DATA, hookStart);
   if(customPayload != NULL) {
     if(strlen(customPayload) < MAX_CUSTOM_DATA_SIZE) {
       root[XIOTModuleJsonTag::custom] = customPayload;
@@ -418,11 +814,20 @@ char* XIOTModule::_buildFullPayload() {
   }
   char* payload = (char*)malloc(JSON_STRING_CONFIG_SIZE);   // TODO: improve ?
   root.printTo(payload, JSON_STRING_CONFIG_SIZE);
+  _builtPayloadHash = _payloadHash(customPayload, globalStatus);
   free(customPayload);
   free(globalStatus);
   return payload;
 }
 
+/**
+ * Hash of the data a duty cycle module posts, to only post it when it changed
+ */
+uint32_t XIOTModule::_payloadHash(const char* customData, const char* globalStatus) {
+  uint32_t hash = XIOTRouter::hash((const uint8_t*)(customData ? customData : ""), customData ? strlen(customData) : 0);
+  return XIOTRouter::hash((const uint8_t*)(globalStatus ? globalStatus : ""), globalStatus ? strlen(globalStatus) : 0, hash);
+}
+
 // Use this method to refresh the module's data on master
 // It's the data the UI is polling
 int XIOTModule::_refreshMaster() {
@@ -464,14 +869,13 @@ char* XIOTModule::emptyMallocedResponse() {
  */
 void XIOTModule::masterAPIGet(const char* path, int* httpCode, char *jsonString, int maxLen) {
   Debug("XIOTModule::masterAPIGet\n");
-  String masterIP = WiFi.gatewayIP().toString();
-  return APIGet(masterIP, path, httpCode, jsonString, maxLen);
+  APIGet(WiFi.gatewayIP(), path, httpCode, jsonString, maxLen);
 }
 
 /**
  * Send a GET request to given IP, handling only the response code 
  */
-void XIOTModule::APIGet(String ipAddr, const char* path, int* httpCode) {
+void XIOTModule::APIGet(const String& ipAddr, const char* path, int* httpCode) {
   return APIGet(ipAddr, path, httpCode, NULL, 0);
 }
 
@@ -479,68 +883,713 @@ void XIOTModule::APIGet(String ipAddr, const char* path, int* httpCode) {
  * Send a GET request to given IP, handling response code and payload 
  */
 
-void XIOTModule::APIGet(String ipAddr, const char* path, int* httpCode, char *jsonString, int maxLen) {
-  Debug("XIOTModule::APIGet\n");
-  HTTPClient http;
-  WiFiClient client;
-  http.begin(client, ipAddr, 80, path);
-  
-  *httpCode = http.GET();
-  if(*httpCode <= 0) {
-    Serial.printf("HTTP GET failed, error: %s\n", http.errorToString(*httpCode).c_str());
+void XIOTModule::APIGet(const String& ipAddr, const char* path, int* httpCode, char *jsonString, int maxLen) {
+  IPAddress ip;
+  if(!ip.fromString(ipAddr)) {
+    *httpCode = HTTPC_ERROR_CONNECTION_REFUSED;
     return;
   }
-  if(jsonString) {
-    String jsonResultStr = http.getString();
-    strlcpy(jsonString, jsonResultStr.c_str(), maxLen);
-  }
-  http.end();
+  APIGet(ip, path, httpCode, jsonString, maxLen);
 }
 
 /**
  * Send a POST request to master 
  * Returns received json
  */
-void XIOTModule::masterAPIPost(const char* path, String payload, int* httpCode, char *jsonString, int maxLen) {
+void XIOTModule::masterAPIPost(const char* path, const String& payload, int* httpCode, char *jsonString, int maxLen) {
+  masterAPIPost(path, payload.c_str(), httpCode, jsonString, maxLen);
+}
+
+void XIOTModule::masterAPIPost(const char* path, const char* payload, int* httpCode, char *response, int maxLen) {
   Debug("XIOTModule::masterAPIPost\n");
-  String masterIP = WiFi.gatewayIP().toString();
-  return APIPost(masterIP, path, payload, httpCode, jsonString, maxLen);
+  APIPost(WiFi.gatewayIP(), path, payload, strlen(payload), httpCode, response, maxLen);
 }
 
 /**
  * Send a POST request to given IP 
  * Returns received json
  */
-void XIOTModule::APIPost(String ipAddr, const char* path, String payload, int* httpCode) {
+void XIOTModule::APIPost(const String& ipAddr, const char* path, const String& payload, int* httpCode) {
   return APIPost(ipAddr, path, payload, httpCode, NULL, 0);
 }
-void XIOTModule::APIPost(char* ipAddr, const char* path, String payload, int* httpCode, char *jsonString, int maxLen) {
-  String ipAddrString = String(ipAddr);
-  APIPost(ipAddrString, path, payload, httpCode, jsonString, maxLen);
+void XIOTModule::APIPost(const char* ipAddr, const char* path, const String& payload, int* httpCode, char *jsonString, int maxLen) {
+  IPAddress ip;
+  if(!ip.fromString(ipAddr)) {
+    *httpCode = HTTPC_ERROR_CONNECTION_REFUSED;
+    return;
+  }
+  APIPost(ip, path, payload.c_str(), payload.length(), httpCode, jsonString, maxLen);
+}
+
+void XIOTModule::APIPost(const String& ipAddr, const char* path, const String& payload, int* httpCode, char *response, int maxLen) {
+  APIPost(ipAddr.c_str(), path, payload, httpCode, response, maxLen);
+}
+
+void XIOTModule::APIPut(const String& ipAddr, const char* path, const String& payload, int* httpCode, char *response, int maxLen) {
+  IPAddress ip;
+  if(!ip.fromString(ipAddr)) {
+    *httpCode = HTTPC_ERROR_CONNECTION_REFUSED;
+    return;
+  }
+  APIPut(ip, path, payload.c_str(), payload.length(), httpCode, response, maxLen);
+}
+
+/**
+ * Requests without String: the response is copied into response (null terminated, truncated
+ * to maxLen - 1 characters) or given by chunks to sink, with context.
+ * On connection error, response contains the error message.
+ */
+void XIOTModule::APIGet(const IPAddress& ip, const char* path, int* httpCode, char *response, int maxLen) {
+  _sendRequestToBuffer(ip, "GET", path, NULL, 0, httpCode, response, maxLen);
+}
+
+void XIOTModule::APIGet(const IPAddress& ip, const char* path, int* httpCode, XIOTResponseSink sink, void* context) {
+  *httpCode = _sendRequest(ip, "GET", path, NULL, 0, sink, context);
+}
+
+void XIOTModule::APIPost(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, char *response, int maxLen) {
+  _sendRequestToBuffer(ip, "POST", path, payload, payloadLength, httpCode, response, maxLen);
+}
+
+void XIOTModule::APIPost(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, XIOTResponseSink sink, void* context) {
+  *httpCode = _sendRequest(ip, "POST", path, payload, payloadLength, sink, context);
+}
+
+void XIOTModule::APIPut(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, char *response, int maxLen) {
+  _sendRequestToBuffer(ip, "PUT", path, payload, payloadLength, httpCode, response, maxLen);
+}
+
+void XIOTModule::APIPut(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, XIOTResponseSink sink, void* context) {
+  *httpCode = _sendRequest(ip, "PUT", path, payload, payloadLength, sink, context);
+}
+
+typedef struct {
+  char* buffer;
+  int maxLen;
+  int length;
+} XIOTResponseBuffer;
+
+// Sink copying the response into a XIOTResponseBuffer, truncating it if needed
+static void responseBufferSink(const char* data, size_t length, void* context) {
+  XIOTResponseBuffer* response = (XIOTResponseBuffer*)context;
+  int toCopy = response->maxLen - 1 - response->length;
+  if(toCopy > (int)length) toCopy = length;
+  if(toCopy <= 0) return;
+  memcpy(response->buffer + response->length, data, toCopy);
+  response->length += toCopy;
+  response->buffer[response->length] = 0;
 }
 
-void XIOTModule::APIPost(String ipAddr, const char* path, String payload, int* httpCode, char *response, int maxLen) {
-  Debug("XIOTModule::APIPost\n");
-//  Serial.println(ipAddr);
-  Serial.println(path);
+void XIOTModule::_sendRequestToBuffer(const IPAddress& ip, const char* method, const char* path, const char* payload, size_t payloadLength,
+                                      int* httpCode, char *response, int maxLen) {
+  XIOTResponseBuffer responseBuffer = {response, maxLen, 0};
+  if(response != NULL && maxLen > 0) {
+    *response = 0;
+  }
+  bool useBuffer = (response != NULL && maxLen > 0);
+  *httpCode = _sendRequest(ip, method, path, payload, payloadLength, useBuffer ? responseBufferSink : NULL, &responseBuffer);
+  if(*httpCode <= 0 && useBuffer) {
+    strlcpy(response, HTTPClient::errorToString(*httpCode).c_str(), maxLen);
+  }
+}
+
+/**
+ * Minimal HTTP/1.0 client: no String is built, headers are read in a stack buffer,
+ * the body is given to sink by chunks (sink can be NULL).
+ * HTTP/1.0 makes sure the response is not chunked.
+ * Returns the HTTP code, or one of the HTTPC_ERROR codes.
+ */
+int XIOTModule::_sendRequest(const IPAddress& ip, const char* method, const char* path, const char* payload, size_t payloadLength,
+                             XIOTResponseSink sink, void* context) {
+  XLog(HTTP, XIOT_LOG_DEBUG, "%s %s", method, path);
   WiFiClient client;
-  HTTPClient http;
-  http.begin(client, ipAddr, 80, path);
-  *httpCode = http.POST(payload);
-  if (*httpCode <= 0) {
-    Serial.printf("HTTP POST failed, error: %s\n", http.errorToString(*httpCode).c_str());
-    if (response != NULL) {
-      strlcpy(response, http.errorToString(*httpCode).c_str(), maxLen);
+  char line[API_HEADER_MAX_LENGTH + 1];
+  int length = snprintf(line, API_HEADER_MAX_LENGTH,
+                        "%s %s HTTP/1.0\r\nHost: %d.%d.%d.%d\r\nConnection: close\r\n"
+                        "Content-Type: application/json\r\nContent-Length: %u\r\n\r\n",
+                        method, path, ip[0], ip[1], ip[2], ip[3], (unsigned int)payloadLength);
+  // Truncated headers (path too long) would not be a valid request
+  if(length < 0 || length >= API_HEADER_MAX_LENGTH) {
+    XLog(HTTP, XIOT_LOG_ERROR, "HTTP %s %s failed, error: %d", method, path, HTTPC_ERROR_SEND_HEADER_FAILED);
+    return HTTPC_ERROR_SEND_HEADER_FAILED;
+  }
+  if(!client.connect(ip, 80)) {
+    XLog(HTTP, XIOT_LOG_ERROR, "HTTP %s %s failed, error: %d", method, path, HTTPC_ERROR_CONNECTION_REFUSED);
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+  }
+  if(client.write((const uint8_t*)line, length) != (size_t)length ||
+     (payloadLength > 0 && client.write((const uint8_t*)payload, payloadLength) != payloadLength)) {
+    XLog(HTTP, XIOT_LOG_ERROR, "HTTP %s %s failed, error: %d", method, path, HTTPC_ERROR_SEND_PAYLOAD_FAILED);
+    client.stop();
+    return HTTPC_ERROR_SEND_PAYLOAD_FAILED;
+  }
+  
+  // Status line, then headers until empty line
+  int httpCode = 0;
+  long contentLength = -1;
+  bool statusLine = true;
+  while(true) {
+    length = _readLine(&client, line, API_HEADER_MAX_LENGTH + 1);
+    if(length < 0) {
+      XLog(HTTP, XIOT_LOG_ERROR, "HTTP %s %s failed, error: %d", method, path, HTTPC_ERROR_READ_TIMEOUT);
+      client.stop();
+      return HTTPC_ERROR_READ_TIMEOUT;
+    }
+    if(statusLine) {
+      const char* code = strchr(line, ' ');
+      httpCode = code ? atoi(code + 1) : 0;
+      statusLine = false;
+      if(httpCode <= 0) {
+        client.stop();
+        return HTTPC_ERROR_NO_HTTP_SERVER;
+      }
+      continue;
+    }
+    if(length == 0) break;
+    if(strncasecmp(line, "Content-Length:", 15) == 0) {
+      contentLength = atol(line + 15);
+    }
+  }
+  
+  // Body
+  char chunk[API_CHUNK_SIZE];
+  unsigned long lastReceived = millis();
+  while(contentLength != 0) {
+    int available = client.available();
+    if(available > 0) {
+      if(available > API_CHUNK_SIZE) available = API_CHUNK_SIZE;
+      if(contentLength > 0 && available > contentLength) available = contentLength;
+      int read = client.read((uint8_t*)chunk, available);
+      if(read > 0) {
+        if(sink != NULL) {
+          sink(chunk, read, context);
+        }
+        if(contentLength > 0) contentLength -= read;
+        lastReceived = millis();
+      }
+    } else if(!client.connected()) {
+      break;
+    } else if(millis() - lastReceived > API_TIMEOUT) {
+      XLog(HTTP, XIOT_LOG_WARN, "HTTP %s %s response timeout", method, path);
+      break;
+    } else {
+      yield();
+    }
+  }
+  client.stop();
+  return httpCode;
+}
+
+/**
+ * Read a header line, without its CRLF, null terminated and truncated to maxLen - 1.
+ * Returns its length, or -1 on timeout or closed connection.
+ */
+int XIOTModule::_readLine(WiFiClient* client, char* line, int maxLen) {
+  int length = 0;
+  unsigned long lastReceived = millis();
+  while(true) {
+    int c = client->read();
+    if(c < 0) {
+      if(!client->connected() && client->available() == 0) return -1;
+      if(millis() - lastReceived > API_TIMEOUT) return -1;
+      yield();
+      continue;
+    }
+    lastReceived = millis();
+    if(c == '\n') break;
+    if(c != '\r' && length < maxLen - 1) {
+      line[length++] = c;
+    }
+  }
+  line[length] = 0;
+  return length;
+}
+
+/**
+ * Make the module work in duty cycle mode: each time it wakes up, customSample() is called,
+ * data is posted to master if it changed, then the module goes to deep sleep for sleepPeriod
+ * seconds. Registration state and time are kept in RTC memory so that master is not queried
+ * on each wake.
+ * With wakesPerPost > 1, radio is only enabled one wake out of wakesPerPost: the other ones
+ * only call customSample(), which can accumulate samples in getSleepUserData() to be sent
+ * by _customData() on the next wake with radio on.
+ * Call this in your sketch setup, after creating the module.
+ * NB: GPIO16 needs to be wired to RST for the module to wake up.
+ */
+void XIOTModule::enableDutyCycle(uint32_t sleepPeriod, uint16_t wakesPerPost) {
+  if(wakesPerPost == 0) {
+    wakesPerPost = 1;
+  }
+  // Keep counters and user data if the module was already in this duty cycle before sleeping
+  if(!_readSleepState() || _sleepState.sleepPeriod != sleepPeriod || _sleepState.wakesPerPost != wakesPerPost) {
+    memset(&_sleepState, 0, sizeof(XIOTSleepState));
+    _sleepState.sleepPeriod = sleepPeriod;
+    _sleepState.wakesPerPost = wakesPerPost;
+  }
+  _dutyCycle = (sleepPeriod > 0);
+}
+
+bool XIOTModule::isDutyCycleEnabled() {
+  return _dutyCycle;
+}
+
+uint32_t XIOTModule::getWakeCount() {
+  return _sleepState.wakeCount;
+}
+
+/**
+ * RTC memory area subclasses can use to keep data between wakes in duty cycle mode.
+ * It's SLEEP_USER_DATA_SIZE bytes long, and saved when going to sleep.
+ */
+uint8_t* XIOTModule::getSleepUserData() {
+  return _sleepState.userData;
+}
+
+bool XIOTModule::_readSleepState() {
+  bool read = ESP.rtcUserMemoryRead(RTC_SLEEP_STATE_OFFSET, (uint32_t*)&_sleepState, sizeof(XIOTSleepState));
+  uint32_t hash = XIOTRouter::hash((const uint8_t*)&_sleepState + sizeof(_sleepState.hash), sizeof(XIOTSleepState) - sizeof(_sleepState.hash));
+  if(!read || hash != _sleepState.hash || _sleepState.sleepPeriod == 0) {
+    memset(&_sleepState, 0, sizeof(XIOTSleepState));
+    return false;
+  }
+  return true;
+}
+
+void XIOTModule::_saveSleepState() {
+  _sleepState.hash = XIOTRouter::hash((const uint8_t*)&_sleepState + sizeof(_sleepState.hash), sizeof(XIOTSleepState) - sizeof(_sleepState.hash));
+  ESP.rtcUserMemoryWrite(RTC_SLEEP_STATE_OFFSET, (uint32_t*)&_sleepState, sizeof(XIOTSleepState));
+}
+
+/**
+ * Duty cycle steps, called from loop(): once registered, sample, post data if needed, wait for
+ * the time synchronization if one is due, sleep.
+ */
+void XIOTModule::_dutyCycleLoop(unsigned int timeNow) {
+  // Radio was disabled for this wake but duty cycle is no longer used: wake up again with radio
+  if(!_dutyCycle) {
+    ESP.deepSleep(1, WAKE_RF_DEFAULT);
+    return;
+  }
+  if(_radioOff) {
+    unsigned long hookStart = micros();
+    customSample();
+    _hookEnd(HOOK_CUSTOM_SAMPLE, hookStart);
+    _goToSleep();
+    return;
+  }
+  // Still connecting or registering
+  if(!_wifiConnected || _canQueryMasterConfig || _canRegister) {
+    if(timeNow >= DUTY_CYCLE_AWAKE_TIMEOUT) {
+      XLog(MODULE, XIOT_LOG_WARN, "Not registered in time");
+      _goToSleep();
+    }
+    return;
+  }
+  if(!_dutyCyclePosted) {
+    _dutyCyclePost();
+    _dutyCyclePosted = true;
+    _timeDutyCyclePosted = millis();
+  }
+  // Read master's reply to a due time synchronization, so that the deep sleep timer error is
+  // corrected and measured
+  if(_timeSync.isPending() && (millis() - _timeDutyCyclePosted < TIME_SYNC_TIMEOUT)) {
+    return;
+  }
+  _goToSleep();
+}
+
+void XIOTModule::_dutyCyclePost() {
+  unsigned long hookStart = micros();
+  customSample();
+  _hookEnd(HOOK_CUSTOM_SAMPLE, hookStart);
+  
+  // Only post if data changed since last time, or for the heartbeat
+  hookStart = micros();
+  char *customData = _customData();
+  _hookEnd(HOOK_CUSTOM_DATA, hookStart);
+  hookStart = micros();
+  char *globalStatus = _globalStatus();
+  _hookEnd(HOOK_GLOBAL_STATUS, hookStart);
+  uint32_t payloadHash = _payloadHash(customData, globalStatus);
+  free(customData);
+  free(globalStatus);
+  uint32_t radioWakes = _sleepState.wakeCount / _sleepState.wakesPerPost;
+  bool heartbeat = !_payloadSent && (radioWakes % DUTY_CYCLE_HEARTBEAT_WAKES) == 0;
+  if(payloadHash != _sleepState.payloadHash || heartbeat) {
+    int httpCode = _refreshMaster();
+    if(httpCode == 200) {
+      _sleepState.payloadHash = payloadHash;
+    } else if(httpCode >= 400 && httpCode < 500) {
+      // Master does not know this module anymore (restarted...): register again next wake
+      XLog(MODULE, XIOT_LOG_WARN, "Refresh refused (%d), registering next wake", httpCode);
+      _registered = false;
+      _sleepState.registered = false;
+      _sleepState.payloadHash = 0;
+    }
+  }
+  _refreshNeeded = false;
+}
+
+void XIOTModule::_goToSleep() {
+  _sleepState.wakeCount ++;
+  _sleepState.registered = _registered;
+  if(_timeInitialized) {
+    _timeSync.suspend(&_sleepState.time);
+  } else {
+    memset(&_sleepState.time, 0, sizeof(XIOTTimeSyncState));
+  }
+  _saveSleepState();
+  bool nextRadioOff = (_sleepState.wakeCount % _sleepState.wakesPerPost) != 0;
+  XLog(MODULE, XIOT_LOG_INFO, "Sleeping %lus after %lums", (unsigned long)_sleepState.sleepPeriod, millis());
+  XIOTLog::drain();
+  Serial.flush();
+  ESP.deepSleep((uint64_t)_sleepState.sleepPeriod * 1000000, nextRadioOff ? WAKE_RF_DISABLED : WAKE_RF_DEFAULT);
+}
+
+/**
+ * Milliseconds since epoch, accurate to a few ms once synchronized with master
+ */
+uint64_t XIOTModule::getEpochMillis() {
+  return _timeSync.epochMillis();
+}
+
+/**
+ * Master needs to call begin(true) and loop(IPAddress(), false) on it to serve its time to agents
+ */
+XIOTTimeSync* XIOTModule::getTimeSync() {
+  return &_timeSync;
+}
+
+/**
+ * Relay mode: the module opens an access point with the same credentials as master's, on its
+ * own subnet (192.168.<subnet>.1), so that agents out of master's range can connect to it.
+ * Relays can't be chained: a relay connected to an access point not on master's subnet
+ * disconnects and avoids its BSSID. Agents connected to a relay don't cache its BSSID, so they
+ * go back to master when it's the best access point at their next connection.
+ * It acts as master for them: it responds to their config, handshake, register and refresh
+ * requests, pings them, and keeps their last payload in a routing table. The changes are sent
+ * to master in one POST /api/relay every RELAY_FLUSH_PERIOD.
+ * Master reaches them through this module with the Xiot-forward-to header.
+ */
+void XIOTModule::enableRelay(uint8_t subnet) {
+  if(_relay) return;
+  if(subnet == MASTER_SUBNET) {
+    XLog(MODULE, XIOT_LOG_ERROR, "Relay subnet can't be master's");
+    return;
+  }
+  _relayedAgents = (XIOTRelayedAgent*)calloc(RELAY_MAX_AGENTS, sizeof(XIOTRelayedAgent));
+  _refusedBssids = (uint8_t (*)[6])calloc(RELAY_MAX_REFUSED_BSSIDS, 6);
+  if(_relayedAgents == NULL || _refusedBssids == NULL) {
+    XLog(MODULE, XIOT_LOG_ERROR, "Not enough memory for relay mode");
+    free(_relayedAgents);
+    free(_refusedBssids);
+    _relayedAgents = NULL;
+    _refusedBssids = NULL;
+    return;
+  }
+  _relay = true;
+  _relaySubnet = subnet;
+  WiFi.mode(WIFI_AP_STA);
+  _startRelayAP();
+  _timeSync.begin(true);   // Serve time to relayed agents
+  
+  addRoute("/api/config", ROUTE_GET, [&]() {
+    _relayRespondConfig(false, false);
+  });
+  addRoute("/api/handshake", ROUTE_POST, [&]() {
+    bool registering = false;
+    bool stored = _relayStorePayload(true, &registering);
+    _relayRespondConfig(true, stored && registering);
+  });
+  addRoute("/api/register", ROUTE_POST, [&]() {
+    bool registering = true;
+    _relaySendAck(_relayStorePayload(false, &registering));
+  });
+  addRoute("/api/refresh", ROUTE_POST, [&]() {
+    bool registering = false;
+    _relaySendAck(_relayStorePayload(false, &registering));
+  });
+}
+
+void XIOTModule::_startRelayAP() {
+  IPAddress apIP(192, 168, _relaySubnet, 1);
+  WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
+  WiFi.softAP(_config->getSsid(), _config->getPwd());
+  XLog(WIFI, XIOT_LOG_INFO, "Relay access point %s on 192.168.%d.1", _config->getSsid(), _relaySubnet);
+}
+
+/**
+ * The access point this relay is connected to is another relay (its subnet is not master's):
+ * remember its BSSID and connect again, avoiding it.
+ */
+void XIOTModule::_relayRefuseAP() {
+  XLog(WIFI, XIOT_LOG_WARN, "Connected to another relay, disconnecting");
+  memcpy(_refusedBssids[_refusedBssidCount % RELAY_MAX_REFUSED_BSSIDS], WiFi.BSSID(), 6);
+  _refusedBssidCount ++;
+  _clearWifiCache();
+  WiFi.disconnect();
+  _connectSTA();
+}
+
+/**
+ * Asynchronous scan result: connect to the strongest access point with the configured SSID that
+ * was not refused. If there is none, scan again after RELAY_SCAN_RETRY_PERIOD.
+ */
+void XIOTModule::_relayConnectToMaster(int count) {
+  _relayScanning = false;
+  int best = -1;
+  for(int i = 0; i < count; i++) {
+    if(strcmp(WiFi.SSID(i).c_str(), _config->getSsid()) != 0) continue;
+    bool refused = false;
+    int refusedCount = (_refusedBssidCount < RELAY_MAX_REFUSED_BSSIDS) ? _refusedBssidCount : RELAY_MAX_REFUSED_BSSIDS;
+    for(int j = 0; j < refusedCount && !refused; j++) {
+      refused = (memcmp(WiFi.BSSID(i), _refusedBssids[j], 6) == 0);
+    }
+    if(!refused && (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best))) {
+      best = i;
+    }
+  }
+  if(best >= 0) {
+    WiFi.begin(_config->getSsid(), _config->getPwd(), WiFi.channel(best), WiFi.BSSID(best));
+    _timeConnectStart = millis();
+  } else {
+    XLog(WIFI, XIOT_LOG_WARN, "No access point to master found");
+    _relayScanNeeded = true;
+    _timeLastRelayScan = millis();
+  }
+  WiFi.scanDelete();
+}
+
+/**
+ * Config for relayed agents: this module's time and access point, which is master's one.
+ * Only available once this module got master's config.
+ */
+void XIOTModule::_relayRespondConfig(bool forHandshake, bool registered) {
+  if(_canQueryMasterConfig || !_wifiConnected) {
+    char message[50];
+    sprintf(message, "{\"%s\": %d}", XIOTModuleJsonTag::retryAfter, REGISTRATION_RETRY_PERIOD);
+    sendJson(message, 503);
+    return;
+  }
+  StaticJsonBuffer<JSON_BUFFER_CONFIG_SIZE> jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  root[XIOTModuleJsonTag::timeInitialized] = _timeInitialized;
+  root[XIOTModuleJsonTag::timestamp] = (long)now();
+  root[XIOTModuleJsonTag::APInitialized] = (strcmp(DEFAULT_APPWD, _config->getPwd()) != 0);
+  root[XIOTModuleJsonTag::APSsid] = _config->getSsid();
+  root[XIOTModuleJsonTag::APPwd] = _config->getPwd();
+  root[XIOTModuleJsonTag::configVersion] = _configVersion;
+  if(forHandshake) {
+    root[XIOTModuleJsonTag::registered] = registered;
+  }
+  char response[JSON_STRING_CONFIG_SIZE];
+  root.printTo(response, JSON_STRING_CONFIG_SIZE);
+  sendJson(response, 200);
+}
+
+void XIOTModule::_relaySendAck(bool stored) {
+  if(stored) {
+    sendJson("{}", 200);
+  } else {
+    char message[50];
+    sprintf(message, "{\"%s\": %d}", XIOTModuleJsonTag::retryAfter, RELAY_FLUSH_PERIOD);
+    sendJson(message, 503);
+  }
+}
+
+/**
+ * Store the payload posted by a relayed agent in the routing table.
+ * For a handshake, registering is set from the request, otherwise it tells whether the payload
+ * is a registration.
+ * Returns false if the payload is invalid or the table is full.
+ */
+bool XIOTModule::_relayStorePayload(bool isHandshake, bool* registering) {
+  String body = _server->arg("plain");
+  char* payload = strdup(body.c_str());
+  if(payload == NULL) return false;
+  StaticJsonBuffer<JSON_BUFFER_CONFIG_SIZE> jsonBuffer;
+  JsonObject& root = jsonBuffer.parseObject(const_cast<char*>(body.c_str()));
+  const char* mac = root[XIOTModuleJsonTag::MAC];
+  if(!root.success() || mac == NULL) {
+    free(payload);
+    return false;
+  }
+  if(isHandshake) {
+    *registering = root[XIOTModuleJsonTag::registerRequest];
+  }
+  XIOTRelayedAgent* agent = _relayFindAgent(mac);
+  if(agent == NULL) {
+    XLog(MODULE, XIOT_LOG_WARN, "Relay table full, %s refused", mac);
+    free(payload);
+    return false;
+  }
+  free(agent->payload);
+  agent->payload = payload;
+  strlcpy(agent->ip, _server->client().remoteIP().toString().c_str(), IP_MAX_LENGTH);
+  // An agent unknown to master needs to be registered even if it's only refreshing
+  agent->toRegister = agent->toRegister || *registering || !agent->registered;
+  agent->dirty = true;
+  agent->connected = true;
+  agent->timeLastSeen = millis();
+  return true;
+}
+
+/**
+ * Returns the routing table entry for this MAC address, creating it if needed.
+ * When the table is full, the entry of the agent disconnected for the longest time is reused,
+ * once master was told it's disconnected.
+ * NULL if there is none.
+ */
+XIOTRelayedAgent* XIOTModule::_relayFindAgent(const char* mac) {
+  XIOTRelayedAgent* freeEntry = NULL;
+  XIOTRelayedAgent* oldestDisconnected = NULL;
+  for(int i = 0; i < RELAY_MAX_AGENTS; i++) {
+    XIOTRelayedAgent* agent = &_relayedAgents[i];
+    if(agent->mac[0] == 0) {
+      if(freeEntry == NULL) freeEntry = agent;
+    } else if(strcmp(agent->mac, mac) == 0) {
+      return agent;
+    } else if(!agent->connected && !agent->dirty) {
+      if(oldestDisconnected == NULL || (millis() - agent->timeLastSeen > millis() - oldestDisconnected->timeLastSeen)) {
+        oldestDisconnected = agent;
+      }
+    }
+  }
+  if(freeEntry == NULL && oldestDisconnected != NULL) {
+    XLog(MODULE, XIOT_LOG_INFO, "Relay table full, forgetting %s", oldestDisconnected->mac);
+    free(oldestDisconnected->payload);
+    memset(oldestDisconnected, 0, sizeof(XIOTRelayedAgent));
+    freeEntry = oldestDisconnected;
+  }
+  if(freeEntry != NULL) {
+    strlcpy(freeEntry->mac, mac, MAC_ADDR_MAX_LENGTH);
+  }
+  return freeEntry;
+}
+
+/**
+ * Ping the relayed agents not seen lately, and send what changed to master
+ * Pings are synchronous: the table is walked one entry every RELAY_PING_PERIOD / RELAY_MAX_AGENTS ms
+ * so that at most one agent is pinged per loop iteration.
+ */
+void XIOTModule::_relayLoop(unsigned int timeNow) {
+  // Looking for master's access point after another relay's one was refused
+  if(_relayScanNeeded && !_relayScanning && (timeNow - _timeLastRelayScan >= RELAY_SCAN_RETRY_PERIOD)) {
+    _relayScanNeeded = false;
+    _relayScanning = true;
+    _timeLastRelayScan = timeNow;
+    WiFi.scanNetworksAsync([&](int count) {
+      _relayConnectToMaster(count);
+    });
+  }
+  if(timeNow - _timeLastRelayPing >= RELAY_PING_PERIOD / RELAY_MAX_AGENTS) {
+    _timeLastRelayPing = timeNow;
+    _relayPingNextAgent();
+  }
+  if(_wifiConnected && _registered && (timeNow - _timeLastRelayFlush >= RELAY_FLUSH_PERIOD)) {
+    _timeLastRelayFlush = timeNow;
+    _relayFlush();
+  }
+}
+
+/**
+ * Ping the next agent of the table if it was not seen lately.
+ * Disconnected agents are not pinged anymore, since a ping to them blocks until the connection
+ * times out: they are forgotten after RELAY_AGENT_EXPIRY, once master was told.
+ */
+void XIOTModule::_relayPingNextAgent() {
+  XIOTRelayedAgent* agent = &_relayedAgents[_relayPingIndex];
+  _relayPingIndex = (_relayPingIndex + 1) % RELAY_MAX_AGENTS;
+  if(agent->mac[0] == 0 || millis() - agent->timeLastSeen < RELAY_PING_PERIOD) return;
+  if(!agent->connected) {
+    if(!agent->dirty && (millis() - agent->timeLastSeen >= RELAY_AGENT_EXPIRY)) {
+      XLog(MODULE, XIOT_LOG_INFO, "Forgetting relayed agent %s", agent->mac);
+      free(agent->payload);
+      memset(agent, 0, sizeof(XIOTRelayedAgent));
     }
     return;
   }
-  if (response != NULL) {
-    int size = http.getSize();
-    Serial.printf("Response size is %d\n", size);
-    String jsonResultStr = http.getString();
-    jsonResultStr.toCharArray(response, size);
+  char* response = (char*)malloc(JSON_STRING_CONFIG_SIZE);
+  if(response == NULL) return;
+  int httpCode;
+  IPAddress ip;
+  ip.fromString(agent->ip);
+  APIGet(ip, "/api/ping", &httpCode, response, JSON_STRING_CONFIG_SIZE);
+  if(httpCode == 200) {
+    free(agent->payload);
+    agent->payload = strdup(response);
+    agent->connected = true;
+    agent->timeLastSeen = millis();
+    agent->dirty = true;
+  } else if(agent->connected) {
+    agent->connected = false;
+    agent->dirty = true;
+  }
+  free(response);
+}
+
+/**
+ * Send the changes of the routing table to master in one request:
+ * {"relay": "<this module ip>", "agents": [{"register": true, "connected": true, "payload": "<agent payload>"}, ...]}
+ * Older masters don't support it: payloads are then posted one by one to /api/register or /api/refresh
+ */
+void XIOTModule::_relayFlush() {
+  int count = 0;
+  for(int i = 0; i < RELAY_MAX_AGENTS; i++) {
+    if(_relayedAgents[i].dirty && _relayedAgents[i].payload != NULL) count ++;
+  }
+  if(count == 0) return;
+  
+  int httpCode = 0;
+  if(_relayBatchSupported) {
+    DynamicJsonBuffer jsonBuffer(JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(count) + count * JSON_OBJECT_SIZE(3));
+    JsonObject& root = jsonBuffer.createObject();
+    root[XIOTModuleJsonTag::relay] = _localIP;
+    JsonArray& agents = root.createNestedArray(XIOTModuleJsonTag::agents);
+    for(int i = 0; i < RELAY_MAX_AGENTS; i++) {
+      XIOTRelayedAgent* agent = &_relayedAgents[i];
+      if(!agent->dirty || agent->payload == NULL) continue;
+      JsonObject& entry = agents.createNestedObject();
+      entry[XIOTModuleJsonTag::registerRequest] = agent->toRegister;
+      entry[XIOTModuleJsonTag::connected] = agent->connected;
+      entry[XIOTModuleJsonTag::payload] = (const char*)agent->payload;  // Not copied
+    }
+    size_t length = root.measureLength();
+    char* batch = (char*)malloc(length + 1);
+    if(batch == NULL) return;
+    root.printTo(batch, length + 1);
+    masterAPIPost("/api/relay", batch, &httpCode);
+    free(batch);
+    if(httpCode == 404) {
+      XLog(MODULE, XIOT_LOG_INFO, "No relay support on master, posting agents one by one");
+      _relayBatchSupported = false;
+    }
+  }
+  for(int i = 0; i < RELAY_MAX_AGENTS; i++) {
+    XIOTRelayedAgent* agent = &_relayedAgents[i];
+    if(!agent->dirty || agent->payload == NULL) continue;
+    if(!_relayBatchSupported) {
+      // Older masters can't be told an agent is disconnected: don't post its last payload as if
+      // it was still alive, master will notice it's not refreshed anymore
+      if(!agent->connected) {
+        agent->dirty = false;
+        continue;
+      }
+      masterAPIPost(agent->toRegister ? "/api/register" : "/api/refresh", agent->payload, &httpCode);
+      if(httpCode >= 400 && httpCode < 500 && !agent->toRegister) {
+        // Master does not know this agent anymore (restarted...): register it next flush
+        XLog(MODULE, XIOT_LOG_WARN, "Refresh of %s refused (%d), registering it again", agent->mac, httpCode);
+        agent->registered = false;
+        agent->toRegister = true;
+        continue;
+      }
+    }
+    if(httpCode == 200) {
+      agent->registered = agent->registered || agent->toRegister;
+      agent->toRegister = false;
+      agent->dirty = false;
+    }
   }
-  http.end();
 }
 
 bool XIOTModule::isWaitingOTA() {
@@ -583,8 +1632,10 @@ void XIOTModule::_setupOTA() {
 }
 
 int XIOTModule::startOTA(const char* ssid, const char* pwd) {
+  unsigned long hookStart = micros();
   bool enabled = customBeforeOTA();
-  Serial.printf("SSID : %s\n", ssid);
+  _hookEnd(HOOK_BEFORE_OTA, hookStart);
+  XLog(MODULE, XIOT_LOG_INFO, "OTA requested, SSID: %s", ssid ? ssid : "");
   if(!enabled) {
     _oledDisplay->setLine(1, "OTA mode refused", TRANSIENT, NOT_BLINKING);
     return 403;  
@@ -595,7 +1646,7 @@ int XIOTModule::startOTA(const char* ssid, const char* pwd) {
   _oledDisplay->setLine(1, "Waiting for OTA", NOT_TRANSIENT, BLINKING);
   _oledDisplay->setLine(2, "", NOT_TRANSIENT, NOT_BLINKING);
   if(ssid != NULL && strlen(ssid) > 0) {
-    Serial.printf("Connecting to %s\n", ssid);
+    XLog(WIFI, XIOT_LOG_INFO, "Connecting to %s for OTA", ssid);
     WiFi.begin(ssid, pwd);
   }
   return 200;
@@ -669,6 +1720,7 @@ void XIOTModule::sendText(const char* msg, int code) {
  * Or you need to handle these by yourself. 
  */
 void XIOTModule::loop() {
+  unsigned long loopStart = micros();
   now(); // Needed to update the clock from the TimeLib library
   // (and used by NTP library)
       
@@ -690,24 +1742,58 @@ void XIOTModule::loop() {
     }
     _oledDisplay->refresh();
     ArduinoOTA.handle();
+    XIOTLog::drain();
     return;
   }
   
+  // Keep time synchronized with master once it gave its config
+  _timeSync.loop(WiFi.gatewayIP(), _wifiConnected && !_canQueryMasterConfig);
+  if(_timeSync.isSynchronized()) {
+    _timeInitialized = true;
+  }
+  
   unsigned int timeNow = millis();
+  if(_reconnectPending && (timeNow - _timeDisconnected >= _registrationSlot())) {
+    _reconnectPending = false;
+    _slotWaited = true;
+    _connectSTA();
+  }
+  // Connecting with the cached BSSID and channel did not work: do a full connection
+  if(_fastConnecting && !_wifiConnected && (timeNow - _timeConnectStart >= FAST_CONNECT_TIMEOUT)) {
+    XLog(WIFI, XIOT_LOG_WARN, "Fast connect failed");
+    _clearWifiCache();
+    _connectSTA();
+  }
   // Should we get the config from master ?
-  if(_wifiConnected && _canQueryMasterConfig && (timeNow - _timeLastGetConfig >= 5000)) {
+  if(_wifiConnected && _canQueryMasterConfig && (timeNow - _timeLastGetConfig >= _getConfigDelay)) {
     _timeLastGetConfig = timeNow;
-    _getConfigFromMaster();
+    _getConfigDelay = REGISTRATION_RETRY_PERIOD;
+    // Older masters don't support the handshake
+    if(!_handshakeSupported || !_handshake()) {
+      _getConfigFromMaster();
+    }
     _oledDisplay->refresh();
     delay(300); // Otherwise message can't be read !
   }
-  if(_wifiConnected && _canRegister && (timeNow - _timeLastRegister >= 5000)) {
+  // With handshake, registration is part of it
+  bool registerInHandshake = _handshakeSupported && _canQueryMasterConfig;
+  if(_wifiConnected && _canRegister && !registerInHandshake && (timeNow - _timeLastRegister >= _registerDelay)) {
     _timeLastRegister = timeNow;
+    _registerDelay = REGISTRATION_RETRY_PERIOD;
     _register(); 
     _oledDisplay->refresh();
     delay(300); // Otherwise message can't be read !
   } 
   
+  if(_relay) {
+    _relayLoop(timeNow);
+  }
+  
+  // Duty cycle: sample, post to master and go back to sleep as soon as possible
+  if(_dutyCycle || _radioOff) {
+    _dutyCycleLoop(timeNow);
+  }
+  
   // Time on display should be refreshed every second
   // Intentionnally not using the value returned by now(), since it changes
   // when time is set.
@@ -723,10 +1809,121 @@ void XIOTModule::loop() {
     // }
   }
   
-  customLoop();
+  // When the previous loop took too long, customLoop can be skipped to let the server,
+  // display, etc. catch up. But not too many times in a row.
+  bool loopIsLate = (_lastLoopDuration > LOOP_BUDGET * 1000);
+  if(_deferHooksWhenLate && loopIsLate && _deferredLoops < HOOK_MAX_DEFERRALS) {
+    _deferredLoops ++;
+  } else {
+    _deferredLoops = 0;
+    unsigned long hookStart = micros();
+    customLoop();
+    _hookEnd(HOOK_CUSTOM_LOOP, hookStart);
+  }
   
   // Display needs to be refreshed continuously (for blinking, ...)
   _oledDisplay->refresh();    
+  
+  // Loop work is done: send pending logs to serial port
+  XIOTLog::drain();
+  _lastLoopDuration = micros() - loopStart;
+  if(_lastLoopDuration > _maxLoopDuration) {
+    _maxLoopDuration = _lastLoopDuration;
+  }
+}
+
+/**
+ * Set the max execution time (ms) of a hook. Longer executions are recorded in the
+ * watchdog ring, returned by GET /api/watchdog.
+ */
+void XIOTModule::setHookBudget(XIOTHook hook, uint32_t budget) {
+  if(hook < HOOK_COUNT) {
+    _hookBudgets[hook] = budget;
+  }
+}
+
+void XIOTModule::_initHookBudgets() {
+  for(int i = 0; i < HOOK_COUNT; i++) {
+    _hookBudgets[i] = HOOK_DEFAULT_BUDGET;
+  }
+}
+
+/**
+ * When true, customLoop is not called after a loop iteration longer than LOOP_BUDGET
+ */
+void XIOTModule::deferHooksWhenLate(bool flag) {
+  _deferHooksWhenLate = flag;
+}
+
+/**
+ * Record the execution time of a hook started at start (micros), and a violation if it's over budget
+ */
+void XIOTModule::_hookEnd(XIOTHook hook, unsigned long start) {
+  uint32_t duration = micros() - start;
+  if(duration > _hookMaxDurations[hook]) {
+    _hookMaxDurations[hook] = duration;
+  }
+  if(duration <= _hookBudgets[hook] * 1000) return;
+  _hookOverruns[hook] ++;
+  XIOTHookViolation* violation = &_hookViolations[_hookViolationCount % WATCHDOG_RING_SIZE];
+  violation->hook = hook;
+  violation->duration = duration;
+  violation->timestamp = _timeInitialized ? now() : millis() / 1000;
+  _hookViolationCount ++;
+  XLog(MODULE, XIOT_LOG_WARN, "%s took %lums", hookNames[hook], (unsigned long)duration / 1000);
+}
+
+/**
+ * Timed calls to customGotConfig and customRegistered, which are called from several places
+ */
+void XIOTModule::_customGotConfig(bool isSuccess) {
+  unsigned long hookStart = micros();
+  customGotConfig(isSuccess);
+  _hookEnd(HOOK_GOT_CONFIG, hookStart);
+}
+
+void XIOTModule::_customRegistered(bool isSuccess) {
+  unsigned long hookStart = micros();
+  customRegistered(isSuccess);
+  _hookEnd(HOOK_REGISTERED, hookStart);
+}
+
+/**
+ * Respond with the hooks budgets and stats, and the most recent violations (oldest first).
+ * Field names carry their unit: budgets are in ms, durations in micro seconds.
+ */
+void XIOTModule::_sendWatchdog() {
+  int violationCount = (_hookViolationCount < WATCHDOG_RING_SIZE) ? _hookViolationCount : WATCHDOG_RING_SIZE;
+  DynamicJsonBuffer jsonBuffer(JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(HOOK_COUNT) + HOOK_COUNT * JSON_OBJECT_SIZE(4)
+                               + JSON_ARRAY_SIZE(WATCHDOG_RING_SIZE) + WATCHDOG_RING_SIZE * JSON_OBJECT_SIZE(3));
+  JsonObject& root = jsonBuffer.createObject();
+  root["loopMaxUs"] = _maxLoopDuration;
+  root["loopLastUs"] = _lastLoopDuration;
+  JsonArray& hooks = root.createNestedArray("hooks");
+  for(int i = 0; i < HOOK_COUNT; i++) {
+    JsonObject& hook = hooks.createNestedObject();
+    hook["name"] = hookNames[i];
+    hook["budgetMs"] = _hookBudgets[i];
+    hook["maxUs"] = _hookMaxDurations[i];
+    hook["overruns"] = _hookOverruns[i];
+  }
+  JsonArray& violations = root.createNestedArray("violations");
+  for(uint32_t i = _hookViolationCount - violationCount; i < _hookViolationCount; i++) {
+    XIOTHookViolation* violation = &_hookViolations[i % WATCHDOG_RING_SIZE];
+    JsonObject& entry = violations.createNestedObject();
+    entry["hook"] = hookNames[violation->hook];
+    entry["durationUs"] = violation->duration;
+    entry["timestamp"] = violation->timestamp;
+  }
+  size_t length = root.measureLength();
+  char* response = (char*)malloc(length + 1);
+  if(response == NULL) {
+    sendJson("{}", 500);
+    return;
+  }
+  root.printTo(response, length + 1);
+  sendJson(response, 200);
+  free(response);
 }
 
 void XIOTModule::hideDateTime(bool flag) {
@@ -748,6 +1945,10 @@ void XIOTModule::customOnStaGotIpHandler(WiFiEventStationModeGotIP ipInfo) {
   // Override this method to implement process once module is connected
 }
 
+void XIOTModule::customSample() {
+  // Override this method to read your sensors each time the module wakes up in duty cycle mode
+}
+
 bool XIOTModule::customBeforeOTA() {
   // Override this method to implement custom processing before initiating OTA.
   // You can block it returning false.
@@ -17,6 +17,9 @@
 #include <XUtils.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include "XIOTRouter.h"
+#include "XIOTTimeSync.h"
+#include "XIOTCommands.h"
 
 extern "C" {
   #include "user_interface.h"  // Allow getting heap size
@@ -25,10 +28,14 @@ extern "C" {
 //#define DEBUG_XIOTMODULE // Uncomment this to enable debug messages over serial port
 
 #ifdef DEBUG_XIOTMODULE
-#define Debug(...) Serial.printf(__VA_ARGS__)
-#else
-#define Debug(...)
+#define XIOT_LOG_LEVEL_MODULE XIOT_LOG_DEBUG
+#define XIOT_LOG_LEVEL_WIFI XIOT_LOG_DEBUG
+#define XIOT_LOG_LEVEL_HTTP XIOT_LOG_DEBUG
+#define XIOT_LOG_LEVEL_PAYLOAD XIOT_LOG_DEBUG
 #endif
+#include "XIOTLog.h"
+
+#define Debug(...) XLog(MODULE, XIOT_LOG_DEBUG, __VA_ARGS__)
 
 // Max length authorized for modules custom data
 #define MAX_GLOBAL_STATUS_SIZE 30
@@ -51,6 +58,31 @@ extern "C" {
 #define JSON_BUFFER_REGISTER_SIZE JSON_OBJECT_SIZE(20)
 #define JSON_STRING_REGISTER_SIZE 1000 + MAX_CUSTOM_DATA_SIZE
 
+// When the master restarts, all agents get their IP at about the same time.
+// Each agent waits for a slot derived from its MAC address (within this window, in ms)
+// before reconnecting after losing its connection, or before querying the config and
+// registering after getting its IP, so that association and requests are spread over time.
+#define REGISTRATION_SLOT_WINDOW 5000
+// Delay between two config or registration attempts, unless master asks for another one
+#define REGISTRATION_RETRY_PERIOD 5000
+// Max delay an agent accepts from master's retryAfter or regSlot, in ms
+#define REGISTRATION_MAX_DELAY 60000
+#define JSON_STRING_REGISTER_RESPONSE_SIZE 100
+
+// Max number of SMS in a POST /api/smsBatch request
+#define SMS_BATCH_MAX_SIZE 20
+
+// Requests to other modules
+#define API_TIMEOUT 5000
+#define API_HEADER_MAX_LENGTH 200
+#define API_CHUNK_SIZE 128
+
+// Called with each chunk of a response body, context is the one given with the request
+typedef void (*XIOTResponseSink)(const char* data, size_t length, void* context);
+
+// Max size of the logs returned by GET /api/logs
+#define LOGS_RESPONSE_MAX_SIZE XIOT_LOG_BUFFER_SIZE
+
 
 class XIOTModuleJsonTag {
 public:
@@ -75,12 +107,122 @@ public:
   static const char* registeringTime;
   static const char* pwd;
   static const char* ssid;
+  static const char* retryAfter;
+  static const char* regSlot;
+  static const char* configVersion;
+  static const char* registerRequest;
+  static const char* registered;
+  static const char* relay;
+  static const char* agents;
+  static const char* payload;
+  static const char* results;
 };
 
+// RTC user memory survives resets and deep sleep. Offsets are in 4 bytes blocks.
+// The first 128 bytes (32 blocks) are used by OTA.
+#define RTC_WIFI_CACHE_OFFSET 32
+#define RTC_SLEEP_STATE_OFFSET (RTC_WIFI_CACHE_OFFSET + sizeof(XIOTWifiCache) / 4)
+
+// When a connection using cached BSSID and channel is not established
+// within this delay (ms), the cache is dropped and a full scan is done.
+#define FAST_CONNECT_TIMEOUT 3000
+
+// Last successful connection to the access point, to reconnect without scanning.
+// The IP address is not cached: after a master restart, its DHCP server could give it to
+// another agent.
+typedef struct {
+  uint32_t hash;      // hash of the following fields, to check the cache is valid
+  uint32_t ssidHash;  // hash of the ssid and password this connection was made with
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t unused;
+} XIOTWifiCache;
+
+// Duty cycle: if a module can't get registered within this delay (ms) after waking up,
+// it goes back to sleep and will try again next time
+#define DUTY_CYCLE_AWAKE_TIMEOUT 30000
+// Even if its data did not change, a module in duty cycle posts to master every
+// this number of wakes with radio on, so that master knows it's still alive.
+#define DUTY_CYCLE_HEARTBEAT_WAKES 10
+// Size of the RTC memory area subclasses can use to keep samples between wakes
+#define SLEEP_USER_DATA_SIZE 64
+
+// Module state kept during deep sleep, to avoid registering or getting config each wake
+typedef struct {
+  uint32_t hash;          // hash of the following fields, to check the state is valid
+  uint32_t sleepPeriod;   // seconds
+  uint32_t payloadHash;   // hash of the custom data and global status last posted to master
+  XIOTTimeSyncState time;
+  uint32_t wakeCount;
+  uint16_t wakesPerPost;  // radio is on only one wake out of wakesPerPost
+  uint8_t registered;
+  uint8_t unused;
+  uint8_t userData[SLEEP_USER_DATA_SIZE];
+} XIOTSleepState;
+
+// Subclass hooks whose execution time is watched
+typedef enum {
+  HOOK_CUSTOM_LOOP,
+  HOOK_USE_DATA,
+  HOOK_PROCESS_SMS,     // customProcessSMS and SMS commands
+  HOOK_CUSTOM_DATA,
+  HOOK_GLOBAL_STATUS,
+  HOOK_CUSTOM_SAMPLE,
+  HOOK_STA_GOT_IP,
+  HOOK_GOT_CONFIG,
+  HOOK_REGISTERED,
+  HOOK_BEFORE_OTA,
+  HOOK_COUNT
+} XIOTHook;
+
+// Default max execution time (ms) of a hook
+#define HOOK_DEFAULT_BUDGET 50
+// Number of most recent budget violations kept
+#define WATCHDOG_RING_SIZE 16
+// A loop iteration longer than this (ms) is late: the next customLoop calls can be deferred
+#define LOOP_BUDGET 100
+// Max number of consecutive loop iterations customLoop can be deferred
+#define HOOK_MAX_DEFERRALS 10
+
+typedef struct {
+  uint8_t hook;
+  uint32_t duration;    // micro seconds
+  uint32_t timestamp;   // seconds since epoch, or since boot if time is not initialized
+} XIOTHookViolation;
+
 #define IP_MAX_LENGTH 16
 #define DOUBLE_IP_MAX_LENGTH 32  // will be handy when slaves can also open AP
 #define MAC_ADDR_MAX_LENGTH 18
 
+// Relay mode: max number of agents connected to a relay
+#define RELAY_MAX_AGENTS 8
+// Master's access point subnet: 192.168.MASTER_SUBNET.x
+#define MASTER_SUBNET 4
+// Relayed agents subnet: 192.168.RELAY_DEFAULT_SUBNET.x, needs to be different from master's
+#define RELAY_DEFAULT_SUBNET 5
+// Number of other relays' BSSIDs a relay remembers to avoid connecting to them
+#define RELAY_MAX_REFUSED_BSSIDS 4
+// Delay (ms) between two scans for master's access point when none was found
+#define RELAY_SCAN_RETRY_PERIOD 10000
+// Delay (ms) between two batches of relayed agents data sent to master
+#define RELAY_FLUSH_PERIOD 5000
+// Relayed agents not seen for this delay (ms) are pinged by the relay
+#define RELAY_PING_PERIOD 30000
+// Disconnected relayed agents are removed from the routing table after this delay (ms)
+#define RELAY_AGENT_EXPIRY 600000
+
+// Routing table entry of a relay, for an agent connected to it
+typedef struct {
+  char mac[MAC_ADDR_MAX_LENGTH];   // Empty for a free entry
+  char ip[IP_MAX_LENGTH];
+  char* payload;                   // Last payload received from the agent, malloced
+  bool registered;                 // Master knows this agent
+  bool toRegister;                 // Next payload sent to master is a registration
+  bool dirty;                      // Payload or connection status not sent to master yet
+  bool connected;
+  unsigned int timeLastSeen;
+} XIOTRelayedAgent;
+
 class XIOTModule {
 // TODO: sort out public/protected stuff, for now it does not really make any sense
 public:
@@ -92,17 +234,26 @@ public:
   virtual void customGotConfig(bool isSuccess);
   virtual bool customBeforeOTA();
   virtual void customOnStaGotIpHandler(WiFiEventStationModeGotIP ipInfo);
+  virtual void customSample();
   
   DisplayClass* getDisplay();
   ESP8266WebServer* getServer();
   void masterAPIGet(const char* path, int* httpCode, char *jsonString, int maxLen);  
-  void masterAPIPost(const char* path, String payload, int* httpCode, char *jsonString = NULL, int maxLen = 0);
-  void APIGet(String ipAddr, const char* path, int* httpCode, char *jsonString, int maxLen);  
-  void APIGet(String ipAddr, const char* path, int* httpCode);  
-  void APIPut(String ipAddr, const char* path, String payload, int* httpCode, char *jsonString, int maxLen);  
-  void APIPost(String ipAddr, const char* path, String payload, int* httpCode, char *jsonString, int maxLen);  
-  void APIPost(char *ipAddr, const char* path, String payload, int* httpCode, char *jsonString, int maxLen);  
-  void APIPost(String ipAddr, const char* path, String payload, int* httpCode);  
+  void masterAPIPost(const char* path, const String& payload, int* httpCode, char *jsonString = NULL, int maxLen = 0);
+  void masterAPIPost(const char* path, const char* payload, int* httpCode, char *jsonString = NULL, int maxLen = 0);
+  void APIGet(const String& ipAddr, const char* path, int* httpCode, char *jsonString, int maxLen);  
+  void APIGet(const String& ipAddr, const char* path, int* httpCode);  
+  void APIPut(const String& ipAddr, const char* path, const String& payload, int* httpCode, char *jsonString, int maxLen);  
+  void APIPost(const String& ipAddr, const char* path, const String& payload, int* httpCode, char *jsonString, int maxLen);  
+  void APIPost(const char *ipAddr, const char* path, const String& payload, int* httpCode, char *jsonString, int maxLen);  
+  void APIPost(const String& ipAddr, const char* path, const String& payload, int* httpCode);  
+  // Same without any String: body as a buffer, response in a buffer or given to a sink
+  void APIGet(const IPAddress& ip, const char* path, int* httpCode, char *response, int maxLen);
+  void APIGet(const IPAddress& ip, const char* path, int* httpCode, XIOTResponseSink sink, void* context);
+  void APIPost(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, char *response, int maxLen);
+  void APIPost(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, XIOTResponseSink sink, void* context);
+  void APIPut(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, char *response, int maxLen);
+  void APIPut(const IPAddress& ip, const char* path, const char* payload, size_t payloadLength, int* httpCode, XIOTResponseSink sink, void* context);
   void sendText(const char* msg, int code);
   void sendHtml(const char* msg, int code);
   void sendJson(const char* msg, int code);
@@ -110,40 +261,135 @@ public:
   void hideDateTime(bool);
   bool _hideDateTime = false;
   void addModuleEndpoints();
+  bool addRoute(const char* path, uint8_t methods, XIOTRouteHandler handler);
+  void onNotFound(XIOTRouteHandler handler);
+  const char* routeParam(uint8_t index);
+  bool addSMSCommand(const char* prefix, XIOTCommandHandler handler, bool adminOnly = false);
   bool isWaitingOTA();
+  void enableDutyCycle(uint32_t sleepPeriod, uint16_t wakesPerPost = 1);
+  bool isDutyCycleEnabled();
+  uint32_t getWakeCount();
+  uint8_t* getSleepUserData();
+  uint64_t getEpochMillis();
+  XIOTTimeSync* getTimeSync();
+  void enableRelay(uint8_t subnet = RELAY_DEFAULT_SUBNET);
+  void setHookBudget(XIOTHook hook, uint32_t budget);
+  void deferHooksWhenLate(bool flag);
   int startOTA(const char* ssid, const char*pwd);
   
 protected:
   void _connectSTA();  
+  void _installRouter();
+  void _sendRequestToBuffer(const IPAddress& ip, const char* method, const char* path, const char* payload, size_t payloadLength,
+                            int* httpCode, char *response, int maxLen);
+  int _sendRequest(const IPAddress& ip, const char* method, const char* path, const char* payload, size_t payloadLength,
+                   XIOTResponseSink sink, void* context);
+  int _readLine(WiFiClient* client, char* line, int maxLen);
+  uint32_t _wifiCredentialsHash();
+  bool _readWifiCache(XIOTWifiCache* cache);
+  void _saveWifiCache();
+  void _clearWifiCache();
+  bool _readSleepState();
+  void _saveSleepState();
+  void _dutyCycleLoop(unsigned int timeNow);
+  void _dutyCyclePost();
+  uint32_t _payloadHash(const char* customData, const char* globalStatus);
+  void _goToSleep();
+  void _startRelayAP();
+  void _relayRefuseAP();
+  void _relayConnectToMaster(int count);
+  void _relayRespondConfig(bool forHandshake, bool registered);
+  void _relaySendAck(bool stored);
+  bool _relayStorePayload(bool isHandshake, bool* registering);
+  XIOTRelayedAgent* _relayFindAgent(const char* mac);
+  void _relayLoop(unsigned int timeNow);
+  void _relayPingNextAgent();
+  void _relayFlush();
+  void _hookEnd(XIOTHook hook, unsigned long start);
+  void _initHookBudgets();
+  void _customGotConfig(bool isSuccess);
+  void _customRegistered(bool isSuccess);
+  void _sendWatchdog();
   void _processPostPut();
   void _setupOTA();
   char* _buildFullPayload();
+  char* _buildPayload(bool forHandshake);
   void _initDisplay(int displayAddr, int displaySda, int displayScl, bool flipScreen = true, uint8_t brightness = 100);
   void _processSMS();
+  void _processSMSBatch();
+  bool _processSMSMessage(const char* phoneNumber, const bool isAdmin, const char* message);
   virtual void _timeDisplay();
   virtual void _wifiDisplay();
   virtual void _getConfigFromMaster();
   virtual void _register();
+  virtual bool _handshake();
+  void _applyMasterConfig(JsonObject& root);
   virtual char* _customData();
   virtual char* _globalStatus();
   virtual char* useData(const char* data, int* responseCode);
   virtual char* emptyMallocedResponse();
   virtual int _refreshMaster();
   virtual bool customProcessSMS(const char* phoneNumber, const bool isAdmin, const char* message);
+  unsigned int _registrationSlot();
+  unsigned int _masterDelay(JsonObject& root, const char* tag, unsigned int defaultDelay);
   
   ModuleConfigClass* _config;
   bool _otaIsStarted = false;
   time_t _otaReadyTime = 0;
   DisplayClass* _oledDisplay;
   ESP8266WebServer* _server;
+  XIOTRouter _router;
+  XIOTCommandTable _smsCommands;
+  bool _routerInstalled = false;
+  XIOTRouteHandler _notFoundHandler = NULL;
   WiFiEventHandler _wifiSTAGotIpHandler, _wifiSTADisconnectedHandler;
   unsigned int _timeLastTimeDisplay = 0;
   unsigned int _timeLastRegister = 0;
   unsigned int _timeLastGetConfig = 0;
+  unsigned int _getConfigDelay = 0;
+  unsigned int _registerDelay = 0;
   bool _wifiConnected = false;
+  bool _fastConnecting = false;
+  unsigned int _timeConnectStart = 0;
+  bool _reconnectPending = false;
+  bool _slotWaited = false;
+  unsigned int _timeDisconnected = 0;
   bool _canQueryMasterConfig = false;
   bool _canRegister = false;
   bool _timeInitialized = false;  
   bool _refreshNeeded = false;  
+  bool _registered = false;
+  bool _handshakeSupported = true;
+  uint32_t _configVersion = 0;
+  bool _dutyCycle = false;
+  bool _radioOff = false;
+  XIOTSleepState _sleepState;
+  bool _dutyCyclePosted = false;
+  uint32_t _builtPayloadHash = 0;   // hash of the data in the last payload built
+  bool _payloadSent = false;        // full payload sent to master during this wake
+  unsigned int _timeDutyCyclePosted = 0;
+  XIOTTimeSync _timeSync;
+  bool _relay = false;
+  bool _relayBatchSupported = true;
+  uint8_t _relaySubnet = RELAY_DEFAULT_SUBNET;
+  unsigned int _timeLastRelayFlush = 0;
+  unsigned int _timeLastRelayPing = 0;
+  uint8_t _relayPingIndex = 0;
+  // Relay mode is optional: allocated by enableRelay()
+  XIOTRelayedAgent* _relayedAgents = NULL;    // RELAY_MAX_AGENTS entries
+  uint8_t (*_refusedBssids)[6] = NULL;        // RELAY_MAX_REFUSED_BSSIDS entries
+  uint8_t _refusedBssidCount = 0;
+  bool _relayScanNeeded = false;
+  bool _relayScanning = false;
+  unsigned int _timeLastRelayScan = 0;
+  uint32_t _hookBudgets[HOOK_COUNT];     // ms
+  uint32_t _hookMaxDurations[HOOK_COUNT] = {0};
+  uint32_t _hookOverruns[HOOK_COUNT] = {0};
+  XIOTHookViolation _hookViolations[WATCHDOG_RING_SIZE];
+  uint32_t _hookViolationCount = 0;
+  uint32_t _lastLoopDuration = 0;
+  uint32_t _maxLoopDuration = 0;
+  bool _deferHooksWhenLate = false;
+  uint8_t _deferredLoops = 0;
   char *_localIP = NULL;
 };
\ No newline at end of file
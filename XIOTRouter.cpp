@@ -0,0 +1,143 @@
+#include "XIOTRouter.h"
+#include "XIOTLog.h"
+
+/**
+ * Add a route. path needs to be a static string since it's not copied.
+ * Returns false if the table is full.
+ */
+bool XIOTRouter::on(const char* path, uint8_t methods, XIOTRouteHandler handler) {
+  if(_routeCount >= ROUTE_MAX_COUNT) {
+    XLog(MODULE, XIOT_LOG_WARN, "Too many routes, %s ignored", path);
+    return false;
+  }
+  XIOTRoute* route = &_routes[_routeCount++];
+  route->hash = hash(path);
+  route->path = path;
+  route->methods = methods;
+  route->hasParams = (strchr(path, ':') != NULL);
+  route->handler = handler;
+  _compiled = false;
+  return true;
+}
+
+/**
+ * Sort the routes: static routes first, ordered on their hash, then routes with parameters
+ * in the order they were added.
+ */
+void XIOTRouter::_compile() {
+  // Few routes, added once: insertion sort is good enough
+  for(int i = 1; i < _routeCount; i++) {
+    for(int j = i; j > 0; j--) {
+      XIOTRoute* previous = &_routes[j - 1];
+      XIOTRoute* current = &_routes[j];
+      bool before = (!current->hasParams && previous->hasParams) ||
+                    (!current->hasParams && !previous->hasParams && current->hash < previous->hash);
+      if(!before) break;
+      std::swap(*previous, *current);
+    }
+  }
+  _staticRouteCount = 0;
+  while(_staticRouteCount < _routeCount && !_routes[_staticRouteCount].hasParams) {
+    _staticRouteCount ++;
+  }
+  _compiled = true;
+}
+
+/**
+ * Call the handler of the route matching uri and method.
+ * Returns false if there is none.
+ */
+bool XIOTRouter::dispatch(const char* uri, HTTPMethod method) {
+  if(!_compiled) {
+    _compile();
+  }
+  uint8_t methodMask = ROUTE_METHOD(method);
+  _paramCount = 0;
+  
+  // Static routes: binary search on the hash, then check the paths sharing it
+  uint32_t uriHash = hash(uri);
+  int low = 0;
+  int high = _staticRouteCount;
+  while(low < high) {
+    int middle = (low + high) / 2;
+    if(_routes[middle].hash < uriHash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  for(int i = low; i < _staticRouteCount && _routes[i].hash == uriHash; i++) {
+    if((_routes[i].methods & methodMask) && strcmp(_routes[i].path, uri) == 0) {
+      _routes[i].handler();
+      return true;
+    }
+  }
+  
+  for(int i = _staticRouteCount; i < _routeCount; i++) {
+    if((_routes[i].methods & methodMask) && _matchParams(_routes[i].path, uri)) {
+      _routes[i].handler();
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Match uri against a pattern like /api/channel/:id, copying parameter values (truncated to
+ * ROUTE_PARAM_MAX_LENGTH).
+ */
+bool XIOTRouter::_matchParams(const char* pattern, const char* uri) {
+  _paramCount = 0;
+  while(*pattern && *uri) {
+    if(*pattern == ':') {
+      if(_paramCount >= ROUTE_MAX_PARAMS || *uri == '/') return false;
+      const char* value = uri;
+      while(*uri && *uri != '/') uri++;
+      int length = uri - value;
+      if(length > ROUTE_PARAM_MAX_LENGTH) length = ROUTE_PARAM_MAX_LENGTH;
+      memcpy(_paramValues[_paramCount], value, length);
+      _paramValues[_paramCount][length] = 0;
+      _paramCount ++;
+      while(*pattern && *pattern != '/') pattern++;
+    } else {
+      if(*pattern != *uri) return false;
+      pattern++;
+      uri++;
+    }
+  }
+  return (*pattern == 0 && *uri == 0);
+}
+
+uint8_t XIOTRouter::paramCount() {
+  return _paramCount;
+}
+
+/**
+ * Returns the value of the index-th parameter of the route being dispatched.
+ * Each parameter has its own buffer: the returned string is valid until next dispatch.
+ */
+const char* XIOTRouter::param(uint8_t index) {
+  if(index >= _paramCount) {
+    return NULL;
+  }
+  return _paramValues[index];
+}
+
+/**
+ * FNV-1a hash of a string
+ */
+uint32_t XIOTRouter::hash(const char* str) {
+  return hash((const uint8_t*)str, strlen(str));
+}
+
+/**
+ * FNV-1a hash, also used by XIOTModule for its caches and registration slot.
+ * Can be chained by passing the previous result as hash.
+ */
+uint32_t XIOTRouter::hash(const uint8_t* data, size_t length, uint32_t hash) {
+  for(size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
@@ -0,0 +1,65 @@
+/**
+ *  Route table for iotinator modules API endpoints
+ *  Xavier Grosjean 2018
+ *  Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International Public License
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WebServer.h>
+#include <functional>
+
+// Max number of routes a module can register (module endpoints included)
+#define ROUTE_MAX_COUNT 32
+// Max number of parameters in a route path, like /api/channel/:id/:state
+#define ROUTE_MAX_PARAMS 4
+#define ROUTE_PARAM_MAX_LENGTH 32
+// FNV-1a initial value, hashes can be chained by passing a previous result instead
+#define FNV_OFFSET_BASIS 2166136261UL
+
+// Methods are given as a bitmask to allow one route to handle several of them
+#define ROUTE_METHOD(method) (1 << (method))
+#define ROUTE_GET ROUTE_METHOD(HTTP_GET)
+#define ROUTE_POST ROUTE_METHOD(HTTP_POST)
+#define ROUTE_PUT ROUTE_METHOD(HTTP_PUT)
+#define ROUTE_DELETE ROUTE_METHOD(HTTP_DELETE)
+#define ROUTE_ANY 0xFF
+
+typedef std::function<void(void)> XIOTRouteHandler;
+
+/**
+ * Routes are added with their path and methods, then compiled (sorted on the hash of their path)
+ * on first dispatch. Dispatching a request is then a binary search on the hash of its uri,
+ * without building any String.
+ * Paths containing parameters (segments starting with ':') are matched segment by segment
+ * after static routes, parameter values are available through param() while the handler runs.
+ */
+class XIOTRouter {
+public:
+  bool on(const char* path, uint8_t methods, XIOTRouteHandler handler);
+  bool dispatch(const char* uri, HTTPMethod method);
+  const char* param(uint8_t index);
+  uint8_t paramCount();
+  static uint32_t hash(const char* str);
+  static uint32_t hash(const uint8_t* data, size_t length, uint32_t hash = FNV_OFFSET_BASIS);
+  
+protected:
+  typedef struct {
+    uint32_t hash;
+    const char* path;       // Needs to be a static string: it is not copied
+    uint8_t methods;
+    bool hasParams;
+    XIOTRouteHandler handler;
+  } XIOTRoute;
+  
+  void _compile();
+  bool _matchParams(const char* pattern, const char* uri);
+  
+  XIOTRoute _routes[ROUTE_MAX_COUNT];
+  uint8_t _routeCount = 0;
+  uint8_t _staticRouteCount = 0;
+  bool _compiled = false;
+  uint8_t _paramCount = 0;
+  char _paramValues[ROUTE_MAX_PARAMS][ROUTE_PARAM_MAX_LENGTH + 1];
+};
@@ -0,0 +1,276 @@
+#include "XIOTTimeSync.h"
+
+/**
+ * Open the UDP port. A server responds to requests, a client sends them.
+ * A module can be both (agent relaying others), calling begin() twice.
+ */
+void XIOTTimeSync::begin(bool isServer) {
+  _isServer = _isServer || isServer;
+  if(_started) return;
+  _started = (_udp.begin(TIME_SYNC_PORT) == 1);
+  // Clock may have been resumed with a better accuracy than TimeLib's
+  if(!_synchronized) {
+    _baseEpochMs = (uint64_t)now() * 1000;
+    _baseMillis = millis();
+  }
+}
+
+/**
+ * To be called continuously: keeps the clock and TimeLib up to date, handles incoming packets
+ * and, for a client, sends a request to server when it's time to synchronize and canSync is true.
+ */
+void XIOTTimeSync::loop(const IPAddress& server, bool canSync) {
+  _updateClock();
+  if(!_started) return;
+  _receive();
+  uint32_t timeNow = millis();
+  if(_pending && (timeNow - _timeLastRequest >= TIME_SYNC_TIMEOUT)) {
+    _pending = false;
+    _retryLater();
+  }
+  if(canSync && !_pending && (_requested || timeNow - _timeLastRequest >= _interval)) {
+    _sendRequest(server);
+  }
+}
+
+/**
+ * Synchronize as soon as possible
+ */
+void XIOTTimeSync::requestSync() {
+  _requested = true;
+}
+
+/**
+ * True while a requested synchronization was not done, or a response is awaited
+ */
+bool XIOTTimeSync::isPending() {
+  return _requested || _pending;
+}
+
+/**
+ * Save the clock state before going to deep sleep
+ */
+void XIOTTimeSync::suspend(XIOTTimeSyncState* state) {
+  // Correction not applied yet is applied at once
+  uint64_t epochMs = epochMillis() + _slewRemaining;
+  state->epoch = epochMs / 1000;
+  state->epochMs = epochMs % 1000;
+  state->synchronized = _synchronized;
+  state->interval = _interval;
+  state->sleptSinceSync = _sleptSinceSync;
+  state->drift = _drift;
+  state->sleepDrift = _sleepDrift;
+}
+
+/**
+ * Restore the clock after sleeping sleepPeriod ms, corrected with the estimated sleep timer error.
+ * A synchronization is requested if it's due.
+ */
+void XIOTTimeSync::resume(const XIOTTimeSyncState* state, uint32_t sleepPeriod) {
+  uint32_t slept = sleepPeriod + (int32_t)(sleepPeriod * state->sleepDrift / 1000000);
+  uint32_t timeNow = millis();
+  // millis() started when waking up
+  _baseEpochMs = (uint64_t)state->epoch * 1000 + state->epochMs + slept + timeNow;
+  _baseMillis = timeNow;
+  _slewRemaining = 0;
+  _synchronized = state->synchronized;
+  _interval = state->interval;
+  _sleptSinceSync = state->sleptSinceSync + slept;
+  _drift = state->drift;
+  _sleepDrift = state->sleepDrift;
+  _resumed = _synchronized;
+  _requested = !_synchronized || (_sleptSinceSync >= _interval);
+  _lastSecond = _baseEpochMs / 1000;
+  setTime(_lastSecond);
+}
+
+/**
+ * Milliseconds since epoch
+ */
+uint64_t XIOTTimeSync::epochMillis() {
+  int32_t slew;
+  return _clock(millis(), &slew);
+}
+
+uint64_t XIOTTimeSync::_clock(uint32_t timeNow, int32_t* slew) {
+  uint32_t elapsed = timeNow - _baseMillis;
+  int64_t corrected = elapsed + (int64_t)(elapsed * _drift / 1000000);
+  int32_t maxSlew = (int32_t)((uint64_t)elapsed * TIME_SYNC_MAX_SLEW / 1000);
+  *slew = _slewRemaining;
+  if(*slew > maxSlew) *slew = maxSlew;
+  if(*slew < -maxSlew) *slew = -maxSlew;
+  return _baseEpochMs + corrected + *slew;
+}
+
+/**
+ * Move the clock base forward, applying the slew so far, and set TimeLib at second boundaries
+ */
+void XIOTTimeSync::_updateClock() {
+  if(!_synchronized) {
+    // Follow TimeLib, which can be set from elsewhere
+    time_t timeNow = now();
+    if(timeNow != _lastSecond) {
+      _lastSecond = timeNow;
+      _baseEpochMs = (uint64_t)timeNow * 1000;
+      _baseMillis = millis();
+    }
+    return;
+  }
+  uint32_t timeNow = millis();
+  // Not too often, to keep slew steps meaningful
+  if(timeNow - _baseMillis >= 100) {
+    int32_t slew;
+    _baseEpochMs = _clock(timeNow, &slew);
+    _baseMillis = timeNow;
+    _slewRemaining -= slew;
+  }
+  time_t second = epochMillis() / 1000;
+  if(second != _lastSecond) {
+    _lastSecond = second;
+    setTime(second);
+  }
+}
+
+void XIOTTimeSync::_receive() {
+  XIOTTimeSyncPacket packet;
+  while(_udp.parsePacket() > 0) {
+    uint64_t receiveTime = epochMillis();
+    int size = _udp.read((uint8_t*)&packet, sizeof(XIOTTimeSyncPacket));
+    if(size != sizeof(XIOTTimeSyncPacket) || packet.magic != TIME_SYNC_MAGIC) continue;
+    if(_isServer && packet.type == TIME_SYNC_REQUEST) {
+      _respond(&packet, receiveTime);
+    } else if(packet.type == TIME_SYNC_RESPONSE) {
+      _processResponse(&packet, receiveTime);
+    }
+  }
+}
+
+void XIOTTimeSync::_respond(XIOTTimeSyncPacket* packet, uint64_t receiveTime) {
+  packet->type = TIME_SYNC_RESPONSE;
+  packet->receive = receiveTime;
+  _udp.beginPacket(_udp.remoteIP(), _udp.remotePort());
+  packet->transmit = epochMillis();
+  _udp.write((const uint8_t*)packet, sizeof(XIOTTimeSyncPacket));
+  _udp.endPacket();
+}
+
+void XIOTTimeSync::_sendRequest(const IPAddress& server) {
+  XIOTTimeSyncPacket packet;
+  memset(&packet, 0, sizeof(XIOTTimeSyncPacket));
+  packet.magic = TIME_SYNC_MAGIC;
+  packet.type = TIME_SYNC_REQUEST;
+  packet.sequence = ++_sequence;
+  _requested = false;
+  _timeLastRequest = millis();
+  _udp.beginPacket(server, TIME_SYNC_PORT);
+  packet.originate = epochMillis();
+  _originate = packet.originate;
+  _udp.write((const uint8_t*)&packet, sizeof(XIOTTimeSyncPacket));
+  _pending = (_udp.endPacket() == 1);
+  if(!_pending) {
+    _retryLater();
+  }
+}
+
+/**
+ * Retry delay doubles with each consecutive failure, so that an unreachable master
+ * is not polled every TIME_SYNC_RETRY_INTERVAL
+ */
+void XIOTTimeSync::_retryLater() {
+  uint32_t interval = TIME_SYNC_RETRY_INTERVAL;
+  for(uint8_t i = 0; i < _failures && interval < TIME_SYNC_MAX_INTERVAL; i++) {
+    interval *= 2;
+  }
+  _interval = (interval > TIME_SYNC_MAX_INTERVAL) ? TIME_SYNC_MAX_INTERVAL : interval;
+  if(_interval < TIME_SYNC_MAX_INTERVAL) {
+    _failures ++;
+  }
+}
+
+void XIOTTimeSync::_processResponse(XIOTTimeSyncPacket* packet, uint64_t receiveTime) {
+  if(!_pending || packet->sequence != _sequence || packet->originate != _originate) return;
+  _pending = false;
+  int64_t rtt = (int64_t)(receiveTime - packet->originate) - (int64_t)(packet->transmit - packet->receive);
+  if(rtt < 0 || rtt > TIME_SYNC_MAX_RTT) {
+    _retryLater();
+    return;
+  }
+  _failures = 0;
+  int64_t offset = ((int64_t)(packet->receive - packet->originate) + (int64_t)(packet->transmit - receiveTime)) / 2;
+  uint32_t timeNow = millis();
+  _rtt = rtt;
+  _offset = offset;
+  
+  if(_resumed && _sleptSinceSync > 0) {
+    // Error accumulated since last synchronization is mostly due to the deep sleep timer
+    _sleepDrift += (float)offset * 1000000 / _sleptSinceSync;
+    if(_sleepDrift > TIME_SYNC_MAX_SLEEP_DRIFT) _sleepDrift = TIME_SYNC_MAX_SLEEP_DRIFT;
+    if(_sleepDrift < -TIME_SYNC_MAX_SLEEP_DRIFT) _sleepDrift = -TIME_SYNC_MAX_SLEEP_DRIFT;
+  }
+  
+  if(!_synchronized || offset > TIME_SYNC_STEP_THRESHOLD || offset < -TIME_SYNC_STEP_THRESHOLD) {
+    // Step
+    _baseEpochMs = epochMillis() + offset;
+    _baseMillis = timeNow;
+    _slewRemaining = 0;
+    _interval = TIME_SYNC_MIN_INTERVAL;
+  } else if(_resumed) {
+    // Module goes back to sleep soon: no time to slew, and the crystal drift can't be measured
+    _baseEpochMs = epochMillis() + offset;
+    _baseMillis = timeNow;
+    _slewRemaining = 0;
+    if(offset < TIME_SYNC_GOOD_OFFSET && offset > -TIME_SYNC_GOOD_OFFSET) {
+      _interval = (_interval * 2 > TIME_SYNC_MAX_INTERVAL) ? TIME_SYNC_MAX_INTERVAL : _interval * 2;
+    } else {
+      _interval = TIME_SYNC_MIN_INTERVAL;
+    }
+  } else {
+    // What remains since last synchronization, apart from the correction not applied yet,
+    // is due to the crystal drift
+    uint32_t elapsed = timeNow - _timeLastSync;
+    if(elapsed >= TIME_SYNC_MIN_INTERVAL / 2) {
+      _drift += (float)(offset - _slewRemaining) * 1000000 / elapsed / 2;
+      if(_drift > TIME_SYNC_MAX_DRIFT) _drift = TIME_SYNC_MAX_DRIFT;
+      if(_drift < -TIME_SYNC_MAX_DRIFT) _drift = -TIME_SYNC_MAX_DRIFT;
+    }
+    _slewRemaining = offset;
+    if(offset < TIME_SYNC_GOOD_OFFSET && offset > -TIME_SYNC_GOOD_OFFSET) {
+      _interval = (_interval * 2 > TIME_SYNC_MAX_INTERVAL) ? TIME_SYNC_MAX_INTERVAL : _interval * 2;
+    } else {
+      _interval = TIME_SYNC_MIN_INTERVAL;
+    }
+  }
+  if(_interval < TIME_SYNC_MIN_INTERVAL) {
+    _interval = TIME_SYNC_MIN_INTERVAL;
+  }
+  _timeLastSync = timeNow;
+  _synchronized = true;
+  _resumed = false;
+  _sleptSinceSync = 0;
+  _lastSecond = 0;   // Set TimeLib right away
+  _updateClock();
+}
+
+bool XIOTTimeSync::isSynchronized() {
+  return _synchronized;
+}
+
+// Last measured offset to server time (ms)
+int32_t XIOTTimeSync::getOffset() {
+  return _offset;
+}
+
+// Last measured round trip time (ms)
+uint32_t XIOTTimeSync::getRtt() {
+  return _rtt;
+}
+
+// Estimated crystal drift (ppm), already compensated
+float XIOTTimeSync::getDrift() {
+  return _drift;
+}
+
+// Current delay between synchronizations (ms)
+uint32_t XIOTTimeSync::getInterval() {
+  return _interval;
+}
@@ -0,0 +1,119 @@
+/**
+ *  Time synchronization between iotinator master and agents
+ *  Xavier Grosjean 2018
+ *  Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International Public License
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <WiFiUdp.h>
+#include <TimeLib.h>
+
+#define TIME_SYNC_PORT 4123
+#define TIME_SYNC_MAGIC 0x58545331   // "XTS1"
+
+// Delays between two synchronizations (ms): starts at min, doubles while offsets are small
+#define TIME_SYNC_MIN_INTERVAL 32000
+#define TIME_SYNC_MAX_INTERVAL 3600000
+// Delay before retrying after a failure (ms): doubles with each consecutive failure, up to max
+#define TIME_SYNC_RETRY_INTERVAL 5000
+#define TIME_SYNC_TIMEOUT 1000
+// Offsets (ms) below this are considered good enough to increase the interval
+#define TIME_SYNC_GOOD_OFFSET 20
+// Offsets (ms) above this are applied at once, smaller ones are slewed
+#define TIME_SYNC_STEP_THRESHOLD 1000
+// Max correction (ms) applied per second when slewing
+#define TIME_SYNC_MAX_SLEW 50
+// Samples with a longer round trip (ms) are not accurate enough and discarded
+#define TIME_SYNC_MAX_RTT 500
+#define TIME_SYNC_MAX_DRIFT 500.0   // ppm
+// The deep sleep timer is much less accurate than the crystal
+#define TIME_SYNC_MAX_SLEEP_DRIFT 50000.0   // ppm
+
+#define TIME_SYNC_REQUEST 1
+#define TIME_SYNC_RESPONSE 2
+
+// Both ends are ESP8266: fields are sent in their native (little endian) order
+typedef struct __attribute__((packed)) {
+  uint32_t magic;
+  uint8_t type;
+  uint8_t unused[3];
+  uint32_t sequence;
+  uint64_t originate;   // client time when sending the request
+  uint64_t receive;     // server time when receiving it
+  uint64_t transmit;    // server time when sending the response
+} XIOTTimeSyncPacket;
+
+// Clock state kept in RTC memory during deep sleep, see suspend() and resume()
+typedef struct {
+  uint32_t epoch;           // seconds, when going to sleep. 0 if time was not initialized
+  uint16_t epochMs;         // milliseconds part
+  uint8_t synchronized;
+  uint8_t unused;
+  uint32_t interval;        // ms
+  uint32_t sleptSinceSync;  // ms
+  float drift;              // ppm, crystal
+  float sleepDrift;         // ppm, deep sleep timer
+} XIOTTimeSyncState;
+
+/**
+ * NTP like synchronization over UDP: the client estimates its offset to the server and the
+ * round trip time, corrects its millisecond clock (stepping large offsets, slewing small ones)
+ * and estimates its crystal drift so that synchronizations become less frequent over time.
+ * TimeLib time is set from this clock at each second boundary.
+ * When not synchronized, the clock just follows TimeLib: that's the case on master, which
+ * serves its time to agents.
+ * Modules in deep sleep keep the clock state in RTC memory: the first synchronization after
+ * waking up measures the deep sleep timer error, which is then compensated on next wakes.
+ */
+class XIOTTimeSync {
+public:
+  void begin(bool isServer);
+  void loop(const IPAddress& server, bool canSync);
+  void requestSync();
+  bool isPending();
+  void suspend(XIOTTimeSyncState* state);
+  void resume(const XIOTTimeSyncState* state, uint32_t sleepPeriod);
+  uint64_t epochMillis();
+  bool isSynchronized();
+  int32_t getOffset();
+  uint32_t getRtt();
+  float getDrift();
+  uint32_t getInterval();
+  
+protected:
+  void _updateClock();
+  void _receive();
+  void _respond(XIOTTimeSyncPacket* packet, uint64_t receiveTime);
+  void _processResponse(XIOTTimeSyncPacket* packet, uint64_t receiveTime);
+  void _sendRequest(const IPAddress& server);
+  void _retryLater();
+  uint64_t _clock(uint32_t timeNow, int32_t* slew);
+  
+  WiFiUDP _udp;
+  bool _started = false;
+  bool _isServer = false;
+  bool _synchronized = false;
+  // Clock: epoch ms at _baseMillis, plus drift correction and pending slew
+  uint64_t _baseEpochMs = 0;
+  uint32_t _baseMillis = 0;
+  int32_t _slewRemaining = 0;
+  float _drift = 0;             // ppm
+  float _sleepDrift = 0;        // ppm
+  uint32_t _sleptSinceSync = 0; // ms
+  bool _resumed = false;        // woken up from deep sleep, not synchronized since
+  time_t _lastSecond = 0;
+  // Synchronization state
+  bool _pending = false;
+  bool _requested = false;
+  uint32_t _sequence = 0;
+  uint64_t _originate = 0;
+  uint32_t _timeLastRequest = 0;
+  uint32_t _timeLastSync = 0;
+  uint32_t _interval = 0;
+  uint8_t _failures = 0;        // consecutive failed synchronizations
+  int32_t _offset = 0;
+  uint32_t _rtt = 0;
+};